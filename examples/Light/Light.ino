@@ -9,15 +9,14 @@
 
 /*
  * The default behavior for a Thing is to send data every 30 seconds.
- * To change its behavior on the firmware side, use the function
- * registerDefaultConfig(). See the documentation and lib examples.
+ * To change its behavior on the firmware side, set the config of its
+ * item in the table below. See the documentation and lib examples.
  */
 
 #include <KNoTThing.h>
 
 #define LIGHT_BULB_PIN      2
 #define LIGHT_BULB_ID       1
-#define LIGHT_BULB_NAME     "Light bulb"
 
 KNoTThing thing;
 
@@ -44,6 +43,15 @@ static int light_write(uint8_t *val)
     return 0;
 }
 
+/* Items are described in flash, so their names take no RAM */
+static const knot_thing_item_def items[] PROGMEM = {
+    { LIGHT_BULB_ID, KNOT_VALUE_TYPE_BOOL, KNOT_TYPE_ID_SWITCH,
+        KNOT_UNIT_NOT_APPLICABLE, 0, "Light bulb",
+        /* Send data every 10 seconds */
+        { KNOT_EVT_FLAG_TIME, 10, {0}, {0} },
+        KNOT_THING_FUNCTIONS(light_read, light_write) },
+};
+
 void setup()
 {
     Serial.begin(9600);
@@ -51,11 +59,7 @@ void setup()
     pinMode(LIGHT_BULB_PIN, OUTPUT);
     /* TODO: Read lamp status from eeprom for reboot cases */
     thing.init("KNoTThing");
-    thing.registerBoolData(LIGHT_BULB_NAME, LIGHT_BULB_ID, KNOT_TYPE_ID_SWITCH,
-        KNOT_UNIT_NOT_APPLICABLE, light_read, light_write);
-
-    /* Send data every 10 seconds*/
-    thing.registerDefaultConfig(LIGHT_BULB_ID, KNOT_EVT_FLAG_TIME, 10, NULL);
+    thing.registerItems(items);
 
     Serial.println(F("Remote Light Bulb KNoT Demo"));
 }
@@ -25,6 +25,7 @@
 #include "knot_types.h"
 
 static GMainLoop *main_loop;
+static guint timeout_id;
 static int32_t speed_value = 0;
 
 static void sig_term(int sig)
@@ -48,9 +49,10 @@ static int speed_write(int32_t *val)
 
 static gboolean loop(gpointer user_data)
 {
-	knot_thing_run();
+	/* Sleep until the thing has work again instead of polling */
+	timeout_id = g_timeout_add(knot_thing_run_tickless(), loop, NULL);
 
-	return TRUE;
+	return FALSE;
 }
 
 #define SPEED_SENSOR_ID		3
@@ -64,7 +66,7 @@ int main(int argc, char *argv[])
 	 * read/write callbacks.
 	 */
 
-	int err, timeout_id;
+	int err;
 
 	knot_data_functions functions;
 	functions.int_f.read = speed_read;
@@ -90,8 +92,8 @@ int main(int argc, char *argv[])
 	knot_thing_config_data_item(SPEED_SENSOR_ID, (KNOT_EVT_FLAG_LOWER_THRESHOLD|KNOT_EVT_FLAG_UPPER_THRESHOLD), 
 	&lower_limit, &upper_limit);
 
-	/* Calls loop() each 1 seconds: simulates Arduino loop function */
-	timeout_id = g_timeout_add_seconds(1, loop, NULL);
+	/* Calls loop() right away; it schedules itself from then on */
+	timeout_id = g_timeout_add(0, loop, NULL);
 
 	g_main_loop_run(main_loop);
 
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host replacement for the Arduino core calls used by the examples;
+ * pins go to the simulated GPIO and Serial to stdout. Included ahead of
+ * a sketch the way the Arduino IDE does it.
+ */
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include "hal/gpio_avr.h"
+
+#define F(str)				(str)
+
+static inline void pinMode(uint8_t pin, uint8_t mode)
+{
+	hal_gpio_pin_mode(pin, mode);
+}
+
+static inline int digitalRead(uint8_t pin)
+{
+	return hal_gpio_digital_read(pin);
+}
+
+static inline void digitalWrite(uint8_t pin, uint8_t value)
+{
+	hal_gpio_digital_write(pin, value);
+}
+
+class HardwareSerial {
+public:
+	void begin(unsigned long baud) { }
+	void print(const char *str) { fputs(str, stdout); }
+	void println(const char *str) { puts(str); }
+	void print(long num) { printf("%ld", num); }
+	void println(long num) { printf("%ld\n", num); }
+};
+
+static HardwareSerial Serial;
+
+#endif /* __HOST_ARDUINO_H__ */
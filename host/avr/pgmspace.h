@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* Host replacement for avr-libc program memory helpers: flash is RAM */
+
+#ifndef __HOST_AVR_PGMSPACE_H__
+#define __HOST_AVR_PGMSPACE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)				(s)
+
+#define pgm_read_byte(addr)		(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)		((uintptr_t)*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)		(*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr)		(*(void * const *)(addr))
+
+#define memcpy_P			memcpy
+#define strncpy_P			strncpy
+#define strlen_P			strlen
+
+#endif /* __HOST_AVR_PGMSPACE_H__ */
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host benchmark for the thing core. Registers a set of int sensors
+ * through KNoTThing, brings the thing online against the simulated
+ * gateway and reports knot_thing_run() throughput and the wall clock
+ * cost of each knot_thing_protocol_run() state.
+ *
+ * With -T the steady state calls runTickless() and skips the virtual
+ * clock ahead by the returned wait, counting wake-ups instead of ticks.
+ *
+ * Usage: bench [-n items] [-i iterations] [-t tick_us] [-c change_ms] [-T]
+ *						[-l loss_pct] [-v]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "KNoTThing.h"
+#include "knot_thing_config.h"
+#include "sim.h"
+#include "gateway.h"
+
+/* knot_thing_run() calls timed together while in STATE_RUNNING */
+#define BATCH				64
+#define STATE_COUNT			(STATE_ERROR + 1)
+
+static const char *state_names[STATE_COUNT] = {
+	"DISCONNECTED", "ACCEPTING", "CONNECTED", "AUTHENTICATING",
+	"REGISTERING", "SCHM", "SCHM_RSP", "ONLINE", "RUNNING", "ERROR"
+};
+
+/* "Sensor N" for every slot the build has */
+static char item_names[KNOT_THING_DATA_MAX][16];
+
+struct state_cost {
+	uint64_t calls;
+	uint64_t ns;
+};
+
+static struct state_cost cost[STATE_COUNT];
+static uint32_t change_ms = 100;
+
+static KNoTThing thing;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Value steps every change_ms of virtual time */
+static int sensor_read(int32_t *val)
+{
+	*val = change_ms ? (int32_t) (sim_time_us() / 1000 / change_ms) : 0;
+
+	return 0;
+}
+
+static void run_timed(uint32_t count, uint32_t tick_us)
+{
+	uint8_t state = knot_thing_protocol_state();
+	uint64_t start;
+	uint32_t i;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		thing.run();
+		sim_time_advance_us(tick_us);
+	}
+
+	cost[state].ns += now_ns() - start;
+	cost[state].calls += count;
+}
+
+/* Wakes only when the thing asks to; a 0 wait still costs one tick */
+static void run_tickless(uint32_t count, uint32_t tick_us)
+{
+	uint64_t start;
+	uint32_t i, next;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		next = thing.runTickless();
+		if (next)
+			sim_time_advance_ms(next);
+		else
+			sim_time_advance_us(tick_us);
+		gw_process();
+	}
+
+	cost[STATE_RUNNING].ns += now_ns() - start;
+	cost[STATE_RUNNING].calls += count;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n items] [-i iterations] [-t tick_us] "
+				"[-c change_ms] [-T] [-l loss_pct] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_comm_stats link;
+	struct gw_stats gw;
+	knot_thing_ram_usage ram;
+	knot_thing_push_stats push;
+#if KNOT_THING_STATS
+	knot_thing_stats stats;
+#endif
+#if KNOT_THING_PROFILE
+	knot_thing_profile prof;
+#endif
+	struct gw_faults faults;
+	uint64_t run_calls, run_ns;
+	uint32_t iterations = 1000000, tick_us = 50, done;
+	uint64_t handshake_us;
+	int items = KNOT_THING_DATA_MAX, opt, i, registered = 0, tickless = 0;
+	uint8_t loss = 0;
+
+	while ((opt = getopt(argc, argv, "n:i:t:c:Tl:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			items = atoi(optarg);
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			tick_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			change_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			tickless = 1;
+			break;
+		case 'l':
+			loss = atoi(optarg);
+			break;
+		case 'v':
+			sim_log_enable(1);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (items < 1 || items > KNOT_THING_DATA_MAX) {
+		fprintf(stderr, "items must be 1..%d\n", KNOT_THING_DATA_MAX);
+		return 1;
+	}
+
+	for (i = 0; i < items; i++)
+		snprintf(item_names[i], sizeof(item_names[i]), "Sensor %d",
+									i + 1);
+
+	sim_reset(1);
+	gw_init(1);
+
+	if (thing.init("KNoT Bench") < 0) {
+		fprintf(stderr, "init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < items; i++) {
+		if (thing.registerIntData(item_names[i], i + 1,
+				KNOT_TYPE_ID_SPEED, KNOT_UNIT_SPEED_MS,
+				sensor_read, NULL) < 0)
+			break;
+
+		thing.registerDefaultConfig(i + 1, KNOT_EVT_FLAG_CHANGE,
+						KNOT_EVT_FLAG_TIME, 30, 0);
+		registered++;
+	}
+
+	/* Handshake: every call timed alone so short states are visible */
+	while (knot_thing_protocol_state() != STATE_RUNNING) {
+		if (sim_time_us() > 600ULL * 1000000) {
+			fprintf(stderr, "thing did not reach RUNNING\n");
+			return 1;
+		}
+
+		run_timed(1, tick_us);
+		gw_process();
+	}
+	handshake_us = sim_time_us();
+
+	/* Loss only hits the steady state */
+	gw_get_faults(&faults);
+	faults.loss = loss;
+	gw_set_faults(&faults);
+
+	/* Steady state: batches amortize the clock reads */
+	for (done = 0; done < iterations; done += BATCH) {
+		if (tickless) {
+			run_tickless(BATCH, tick_us);
+			continue;
+		}
+
+		run_timed(BATCH, tick_us);
+		gw_process();
+	}
+
+	run_calls = cost[STATE_RUNNING].calls;
+	run_ns = cost[STATE_RUNNING].ns;
+
+	sim_link_stats(&link);
+	gw_get_stats(&gw);
+
+	printf("items registered   %d of %d (KNOT_THING_DATA_MAX %d)\n",
+				registered, items, KNOT_THING_DATA_MAX);
+	knot_thing_get_ram_usage(&ram);
+	printf("item table RAM     %u bytes per slot, %u total, %u used by "
+		"%u items\n", ram.item_bytes, ram.total_bytes,
+		ram.item_bytes * ram.items, ram.items);
+	printf("virtual tick       %u us, value change every %u ms\n",
+							tick_us, change_ms);
+	printf("time to RUNNING    %.2f ms (virtual)\n", handshake_us / 1000.0);
+	printf("run iterations/s   %.0f\n",
+			run_ns ? run_calls * 1e9 / run_ns : 0.0);
+	printf("wake-ups           %.1f per virtual second over %.1f s\n",
+		run_calls / ((sim_time_us() - handshake_us) / 1e6),
+		(sim_time_us() - handshake_us) / 1e6);
+	printf("\n%-16s %12s %12s %12s\n", "state", "calls", "avg ns",
+								"total us");
+	for (i = 0; i < STATE_COUNT; i++) {
+		if (cost[i].calls == 0)
+			continue;
+
+		printf("%-16s %12llu %12.1f %12.1f\n", state_names[i],
+				(unsigned long long) cost[i].calls,
+				(double) cost[i].ns / cost[i].calls,
+				cost[i].ns / 1000.0);
+	}
+
+	printf("\nframes to gateway  %u (pushes %u, schema %u+%u)\n",
+		link.frames_to_gw, gw.pushes, gw.schema_frags, gw.schema_ends);
+	printf("frames to thing    %u\n", link.frames_to_thing);
+
+	knot_thing_protocol_push_stats(&push);
+	if (push.sent) {
+		printf("pushes tracked     %u sent, %u acked, %u failed, %u timed "
+			"out, %u resent, %u lost, %u untracked\n", push.sent,
+			push.acked, push.failed, push.timeouts, push.resent,
+			push.lost, push.untracked);
+		printf("push latency       avg %.1f max %u ms\n", push.acked ?
+			(double) push.latency_sum_ms / push.acked : 0.0,
+			push.latency_max_ms);
+	}
+	printf("hal_comm_read      %.2f per iteration\n",
+		(double) link.reads / (run_calls ? run_calls : 1));
+
+#if KNOT_THING_STATS
+	knot_thing_get_stats(&stats);
+	printf("thing counters     %u frames sent, %u received, %u write "
+		"errors, %u dropped, %u link losses\n", stats.frames_sent,
+		stats.frames_received, stats.write_errors, stats.tx_dropped,
+		stats.link_losses);
+	printf("thing events       %u sent, %u suppressed, %u ms running\n",
+		stats.events_sent, stats.events_suppressed,
+		stats.state_ms[STATE_RUNNING]);
+#endif
+
+#if KNOT_THING_PROFILE
+	knot_thing_get_loop_profile(&prof);
+	printf("loop profile       %u calls, min %u avg %u max %u us, %u over "
+		"%u us\n", prof.calls, prof.min_us, prof.avg_us, prof.max_us,
+		prof.overruns, KNOT_THING_LOOP_BUDGET_US);
+	for (i = 0; i < registered; i++) {
+		if (knot_thing_get_item_profile(i + 1, &prof) < 0 ||
+							prof.overruns == 0)
+			continue;
+
+		printf("sensor %-3d         %u calls, avg %u max %u us, %u over "
+			"%u us\n", i + 1, prof.calls, prof.avg_us,
+			prof.max_us, prof.overruns,
+			KNOT_THING_CALLBACK_BUDGET_US);
+	}
+#endif
+
+	return 0;
+}
@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Functional checks of the optional thing features. Each scenario boots
+ * a thing against the simulated gateway, drives it with known inputs
+ * and compares the messages the gateway gets with the expected ones.
+ * "make check" builds it with the options the scenarios need.
+ *
+ * Usage: check [-v]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "KNoTThing.h"
+#include "knot_thing_config.h"
+#include "sim.h"
+#include "gateway.h"
+
+#if !KNOT_THING_ASYNC
+#error "check needs KNOT_THING_ASYNC"
+#endif
+
+#if !KNOT_THING_FILTER || !KNOT_THING_STATS
+#error "check needs KNOT_THING_FILTER and KNOT_THING_STATS"
+#endif
+
+/* Data messages the gateway got, in order */
+#define SEEN_MAX			64
+
+struct seen_msg {
+	uint8_t type;
+	uint8_t sensor_id;
+	uint8_t len;			/* Payload bytes after the sensor id */
+	knot_data payload;
+};
+
+static struct seen_msg seen[SEEN_MAX];
+static uint8_t seen_count;
+static int failures;
+
+#define CHECK(cond)	check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *expr, int line)
+{
+	if (ok)
+		return;
+
+	printf("  FAIL line %d: %s\n", line, expr);
+	failures++;
+}
+
+static void gw_msg(const knot_msg *msg)
+{
+	struct seen_msg *s;
+
+	switch ((int8_t) msg->hdr.type) {
+	case KNOT_MSG_PUSH_DATA_REQ:
+	case KNOT_MSG_PUSH_DATA_RSP:
+	case KNOT_ERR_INVALID:
+	case KNOT_ERR_PERM:
+		break;
+	default:
+		return;
+	}
+
+	if (seen_count == SEEN_MAX || msg->hdr.payload_len < 1)
+		return;
+
+	s = &seen[seen_count++];
+	s->type = msg->hdr.type;
+	s->sensor_id = msg->data.sensor_id;
+	s->len = msg->hdr.payload_len - sizeof(msg->data.sensor_id);
+	memcpy(&s->payload, &msg->data.payload,
+			s->len < sizeof(s->payload) ? s->len : sizeof(s->payload));
+}
+
+/* Last data message of the sensor, NULL if none came since the reset */
+static const struct seen_msg *seen_last(uint8_t sensor_id)
+{
+	uint8_t i;
+
+	for (i = seen_count; i > 0; i--)
+		if (seen[i - 1].sensor_id == sensor_id)
+			return &seen[i - 1];
+
+	return NULL;
+}
+
+/* Data pushes of the sensor since the last reset */
+static uint8_t seen_pushes(uint8_t sensor_id)
+{
+	uint8_t i, count = 0;
+
+	for (i = 0; i < seen_count; i++)
+		if (seen[i].sensor_id == sensor_id &&
+				seen[i].type == KNOT_MSG_PUSH_DATA_REQ)
+			count++;
+
+	return count;
+}
+
+static void run_ms(uint32_t ms)
+{
+	uint64_t end = sim_time_us() + (uint64_t) ms * 1000;
+
+	while (sim_time_us() < end) {
+		knot_thing_run();
+		gw_process();
+		sim_time_advance_ms(1);
+	}
+}
+
+/* Fresh thing and gateway; items are registered before online() */
+static void boot(const char *name)
+{
+	sim_reset(1);
+	gw_init(1);
+	gw_set_msg_func(gw_msg);
+	knot_thing_init(name);
+}
+
+static int online(void)
+{
+	while (knot_thing_protocol_state() != STATE_RUNNING) {
+		if (sim_time_us() > 60ULL * 1000000)
+			return -1;
+
+		run_ms(1);
+	}
+
+	seen_count = 0;
+
+	return 0;
+}
+
+/* No report of its own: the item is only read when polled */
+static void quiet(uint8_t sensor_id)
+{
+	knot_value_type none;
+
+	none.val_i = 0;
+	knot_thing_config_data_item(sensor_id, KNOT_EVT_FLAG_NONE, 0,
+								&none, &none);
+}
+
+/*
+ * KNOT_THING_ASYNC: a read and a write that return KNOT_THING_PENDING,
+ * completed with success, with an error and not at all.
+ */
+static int32_t async_reads, async_writes, async_written;
+
+static int async_read(int32_t *val)
+{
+	async_reads++;
+
+	return KNOT_THING_PENDING;
+}
+
+static int async_write(int32_t *val)
+{
+	async_writes++;
+	async_written = *val;
+
+	return KNOT_THING_PENDING;
+}
+
+static int32_t plain_value;
+
+static int plain_read(int32_t *val)
+{
+	*val = plain_value;
+
+	return 0;
+}
+
+static void poll_item(uint8_t sensor_id)
+{
+	knot_msg msg;
+
+	msg.item.hdr.type = KNOT_MSG_POLL_DATA_REQ;
+	msg.item.hdr.payload_len = sizeof(msg.item.sensor_id);
+	msg.item.sensor_id = sensor_id;
+	gw_send(&msg, sizeof(msg.item));
+}
+
+static void write_item(uint8_t sensor_id, int32_t value)
+{
+	knot_msg msg;
+
+	msg.data.hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+	msg.data.hdr.payload_len = sizeof(msg.data.sensor_id) +
+							sizeof(value);
+	msg.data.sensor_id = sensor_id;
+	msg.data.payload.val_i = value;
+	gw_send(&msg, sizeof(msg.data.hdr) + msg.data.hdr.payload_len);
+}
+
+static void check_async(void)
+{
+	knot_data_functions async_f, plain_f;
+	const struct seen_msg *s;
+	int32_t value;
+
+	async_f.int_f.read = async_read;
+	async_f.int_f.write = async_write;
+	plain_f.int_f.read = plain_read;
+	plain_f.int_f.write = NULL;
+
+	boot("KNoT Check Async");
+	knot_thing_register_data_item(1, "Slow", KNOT_TYPE_ID_SPEED,
+		KNOT_VALUE_TYPE_INT, KNOT_UNIT_SPEED_MS, &async_f);
+	knot_thing_register_data_item(2, "Fast", KNOT_TYPE_ID_SPEED,
+		KNOT_VALUE_TYPE_INT, KNOT_UNIT_SPEED_MS, &plain_f);
+	quiet(1);
+	quiet(2);
+
+	/* The online push of the slow item waits for its value */
+	CHECK(online() == 0);
+	CHECK(async_reads == 1);
+	value = 42;
+	CHECK(knot_thing_complete_read(1, &value, sizeof(value)) == 0);
+	CHECK(knot_thing_complete_read(1, &value, sizeof(value)) < 0);
+	run_ms(20);
+	s = seen_last(1);
+	CHECK(s && s->type == KNOT_MSG_PUSH_DATA_REQ && s->payload.val_i == 42);
+
+	/* Failed read, after the fast item left its id in the message */
+	poll_item(2);
+	run_ms(20);
+	poll_item(1);
+	run_ms(20);
+	CHECK(async_reads == 2);
+	CHECK(knot_thing_complete_read(1, NULL, 0) == 0);
+	run_ms(20);
+	s = seen_last(1);
+	CHECK(s && (int8_t) s->type == KNOT_ERR_PERM);
+	CHECK(seen_last(2) && seen_last(2)->type == KNOT_MSG_PUSH_DATA_REQ);
+
+	/* Read never completed: fails once KNOT_THING_ASYNC_TIMEOUT_MS is up */
+	poll_item(2);
+	run_ms(20);
+	seen_count = 0;
+	poll_item(1);
+	run_ms(KNOT_THING_ASYNC_TIMEOUT_MS + 100);
+	CHECK(async_reads == 3);
+	s = seen_last(1);
+	CHECK(s && (int8_t) s->type == KNOT_ERR_PERM);
+	CHECK(seen_count == 1);
+	CHECK(knot_thing_complete_read(1, &value, sizeof(value)) < 0);
+
+	/* Write echoed once done, or answered with an error */
+	write_item(1, 7);
+	run_ms(20);
+	CHECK(async_writes == 1 && async_written == 7);
+	CHECK(seen_last(1) == s);
+	CHECK(knot_thing_complete_write(1, 0) == 0);
+	run_ms(20);
+	s = seen_last(1);
+	CHECK(s && s->type == KNOT_MSG_PUSH_DATA_RSP && s->payload.val_i == 7);
+
+	write_item(1, 8);
+	run_ms(20);
+	CHECK(knot_thing_complete_write(1, -1) == 0);
+	run_ms(20);
+	s = seen_last(1);
+	CHECK(s && (int8_t) s->type == KNOT_ERR_INVALID);
+
+	knot_thing_exit();
+}
+
+/*
+ * KNoTThing::registerData(): items served by member functions of one
+ * object and by functors, read and written through the context table.
+ */
+class Scale {
+public:
+	int32_t grams;
+	float temperature;
+	uint8_t tared;
+
+	int readGrams(int32_t *val)
+	{
+		*val = grams;
+		return 0;
+	}
+
+	int writeGrams(int32_t *val)
+	{
+		grams = *val;
+		return 0;
+	}
+
+	int readTemperature(float *val)
+	{
+		*val = temperature;
+		return 0;
+	}
+
+	int readTared(uint8_t *val)
+	{
+		*val = tared;
+		return 0;
+	}
+};
+
+struct Counter {
+	int32_t calls;
+
+	int operator()(int32_t *val)
+	{
+		*val = ++calls;
+		return 0;
+	}
+};
+
+static KNoTThing thing;
+
+static void check_register_data(void)
+{
+	const struct seen_msg *s;
+	Scale scale = { 500, 21.5f, 1 };
+	Counter counter = { 100 };
+	knot_msg_data data;
+
+	boot("KNoT Check Data");
+	CHECK((thing.registerData<int32_t, Scale, &Scale::readGrams,
+		&Scale::writeGrams>("Grams", 1, KNOT_TYPE_ID_SPEED,
+					KNOT_UNIT_SPEED_MS, scale)) == 0);
+	CHECK((thing.registerData<float, Scale, &Scale::readTemperature>(
+			"Temperature", 2, KNOT_TYPE_ID_TEMPERATURE,
+			KNOT_UNIT_TEMPERATURE_C, scale)) == 0);
+	CHECK((thing.registerData<uint8_t, Scale, &Scale::readTared>(
+			"Tared", 3, KNOT_TYPE_ID_SWITCH, KNOT_UNIT_NOT_APPLICABLE,
+			scale)) == 0);
+	CHECK((thing.registerData<int32_t>("Counter", 4, KNOT_TYPE_ID_NONE,
+			KNOT_UNIT_NOT_APPLICABLE, counter)) == 0);
+	CHECK(knot_thing_get_value_type(2) == KNOT_VALUE_TYPE_FLOAT);
+	CHECK(knot_thing_get_value_type(3) == KNOT_VALUE_TYPE_BOOL);
+	quiet(1);
+	quiet(2);
+	quiet(3);
+	quiet(4);
+
+	/* Read directly, then as the gateway polls */
+	CHECK(knot_thing_data_item_read(1, &data) == 0);
+	CHECK(data.hdr.payload_len == 1 + sizeof(int32_t) &&
+						data.payload.val_i == 500);
+	CHECK(knot_thing_data_item_read(3, &data) == 0);
+	CHECK(data.hdr.payload_len == 1 + 1 && data.payload.val_b == 1);
+
+	/* Each item is read once for the online push */
+	CHECK(online() == 0);
+	CHECK(counter.calls == 101);
+
+	scale.grams = 750;
+	scale.temperature = -3.25f;
+	poll_item(1);
+	poll_item(2);
+	poll_item(4);
+	run_ms(20);
+	s = seen_last(1);
+	CHECK(s && s->type == KNOT_MSG_PUSH_DATA_REQ && s->payload.val_i == 750);
+	s = seen_last(2);
+	CHECK(s && s->len == sizeof(float) && s->payload.val_f == -3.25f);
+	s = seen_last(4);
+	CHECK(s && s->payload.val_i == 102);
+
+	/* Written by the member function; read-only items refuse */
+	write_item(1, 1234);
+	run_ms(20);
+	CHECK(scale.grams == 1234);
+	s = seen_last(1);
+	CHECK(s && s->type == KNOT_MSG_PUSH_DATA_RSP && s->payload.val_i == 1234);
+	write_item(4, 1);
+	run_ms(20);
+	s = seen_last(4);
+	CHECK(s && (int8_t) s->type == KNOT_ERR_INVALID);
+	CHECK(counter.calls == 102);
+
+	knot_thing_exit();
+}
+
+/*
+ * KNOT_THING_FILTER: a known waveform on three items, one per filter,
+ * and the events that must get through each of them.
+ */
+struct Wave {
+	int32_t value;
+
+	int operator()(int32_t *val)
+	{
+		*val = value;
+		return 0;
+	}
+};
+
+/* Sets the item value and lets a few sweeps see it */
+static void wave_step(Wave &wave, int32_t value)
+{
+	wave.value = value;
+	run_ms(50);
+}
+
+static void check_filter(void)
+{
+	const struct seen_msg *s;
+	Wave band = { 100 }, limit = { 40 }, interval = { 0 };
+	knot_thing_item_stats stats;
+	knot_thing_filter filter;
+	knot_value_type lower, upper;
+
+	boot("KNoT Check Filter");
+	thing.registerData<int32_t>("Deadband", 1, KNOT_TYPE_ID_SPEED,
+				KNOT_UNIT_SPEED_MS, band);
+	thing.registerData<int32_t>("Limit", 2, KNOT_TYPE_ID_SPEED,
+				KNOT_UNIT_SPEED_MS, limit);
+	thing.registerData<int32_t>("Interval", 3, KNOT_TYPE_ID_SPEED,
+				KNOT_UNIT_SPEED_MS, interval);
+
+	lower.val_i = INT32_MIN;
+	upper.val_i = INT32_MAX;
+	knot_thing_config_data_item(1, KNOT_EVT_FLAG_CHANGE, 0, &lower, &upper);
+	knot_thing_config_data_item(3, KNOT_EVT_FLAG_CHANGE, 0, &lower, &upper);
+	upper.val_i = 50;
+	knot_thing_config_data_item(2, KNOT_EVT_FLAG_UPPER_THRESHOLD, 0,
+							&lower, &upper);
+
+	memset(&filter, 0, sizeof(filter));
+	filter.deadband.val_i = 10;
+	CHECK(knot_thing_filter_data_item(1, &filter) == 0);
+	memset(&filter, 0, sizeof(filter));
+	filter.hysteresis.val_i = 5;
+	CHECK(knot_thing_filter_data_item(2, &filter) == 0);
+	memset(&filter, 0, sizeof(filter));
+	filter.min_interval_ms = 1000;
+	CHECK(knot_thing_filter_data_item(3, &filter) == 0);
+
+	CHECK(online() == 0);
+	run_ms(1100);
+	seen_count = 0;
+
+	/* Deadband 10 around the last value sent: 100, then 111 */
+	wave_step(band, 105);
+	CHECK(seen_pushes(1) == 0);
+	wave_step(band, 111);
+	s = seen_last(1);
+	CHECK(seen_pushes(1) == 1 && s && s->payload.val_i == 111);
+	wave_step(band, 104);
+	wave_step(band, 120);
+	CHECK(seen_pushes(1) == 1);
+	wave_step(band, 99);
+	s = seen_last(1);
+	CHECK(seen_pushes(1) == 2 && s && s->payload.val_i == 99);
+	CHECK(knot_thing_get_item_stats(1, &stats) == 0);
+	CHECK(stats.events_suppressed >= 3);
+
+	/* Upper limit 50 re-armed once back under 45 */
+	wave_step(limit, 51);
+	s = seen_last(2);
+	CHECK(seen_pushes(2) == 1 && s && s->payload.val_i == 51);
+	wave_step(limit, 47);
+	wave_step(limit, 52);
+	CHECK(seen_pushes(2) == 1);
+	wave_step(limit, 44);
+	wave_step(limit, 53);
+	s = seen_last(2);
+	CHECK(seen_pushes(2) == 2 && s && s->payload.val_i == 53);
+
+	/* Changes 1 s apart at most, the last value of the window sent */
+	wave_step(interval, 1);
+	CHECK(seen_pushes(3) == 1);
+	wave_step(interval, 2);
+	run_ms(300);
+	wave_step(interval, 3);
+	run_ms(300);
+	wave_step(interval, 4);
+	CHECK(seen_pushes(3) == 1);
+	run_ms(300);
+	s = seen_last(3);
+	CHECK(seen_pushes(3) == 2 && s && s->payload.val_i == 4);
+
+	knot_thing_exit();
+}
+
+struct scenario {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct scenario scenarios[] = {
+	{ "async read and write", check_async },
+	{ "registerData templates", check_register_data },
+	{ "deadband, hysteresis and min interval", check_filter },
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	int opt, before;
+
+	while ((opt = getopt(argc, argv, "vh")) != -1) {
+		switch (opt) {
+		case 'v':
+			sim_log_enable(1);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		before = failures;
+		printf("%s\n", scenarios[i].name);
+		scenarios[i].run();
+		printf("  %s\n", failures == before ? "ok" : "FAILED");
+	}
+
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "knot_protocol.h"
+#include "knot_thing_main.h"
+#include "sim.h"
+#include "gateway.h"
+
+/* Frames held by the latency model, both directions */
+#define GW_DELAY_LINE			64
+
+#define DIR_TO_GW			0
+#define DIR_TO_THING			1
+
+struct gw_frame {
+	uint64_t due_us;
+	uint16_t len;
+	uint8_t dir;
+	uint8_t buf[SIM_FRAME_MAX];
+};
+
+static const char gw_uuid[] = "a1b2c3d4-0000-4000-8000-00000000beef";
+static const char gw_token[] = "0123456789abcdef0123456789abcdef01234567";
+
+static struct gw_stats stats;
+static struct gw_faults faults;
+static struct gw_frame line[GW_DELAY_LINE];
+static uint8_t line_count;
+static uint64_t last_due[2];
+static uint64_t listen_us, flap_us;
+static uint32_t rand_state;
+static gw_msg_func msg_func;
+
+static uint32_t gw_random(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+static int chance(uint8_t pct)
+{
+	return pct && (gw_random() % 100) < pct;
+}
+
+static void line_put(uint8_t dir, const void *buf, size_t len)
+{
+	struct gw_frame *frame;
+	uint64_t due;
+
+	if (line_count == GW_DELAY_LINE || len > SIM_FRAME_MAX) {
+		stats.dropped++;
+		return;
+	}
+
+	due = sim_time_us() + (uint64_t) faults.delay_ms * 1000;
+	if (faults.jitter_ms)
+		due += (gw_random() % (faults.jitter_ms * 1000 + 1));
+
+	/* The radio link does not reorder frames */
+	if (due < last_due[dir])
+		due = last_due[dir];
+	last_due[dir] = due;
+
+	frame = &line[line_count++];
+	frame->due_us = due;
+	frame->dir = dir;
+	frame->len = len;
+	memcpy(frame->buf, buf, len);
+}
+
+/* Apply loss and duplication, then queue for delivery */
+static void transmit(uint8_t dir, const void *buf, size_t len)
+{
+	if (chance(faults.loss)) {
+		stats.dropped++;
+		return;
+	}
+
+	line_put(dir, buf, len);
+
+	if (chance(faults.duplicate)) {
+		stats.duplicated++;
+		line_put(dir, buf, len);
+	}
+}
+
+static void send_result(uint8_t type, int8_t result)
+{
+	knot_msg rsp;
+
+	rsp.action.hdr.type = type;
+	rsp.action.hdr.payload_len = sizeof(rsp.action.result);
+	rsp.action.result = result;
+	transmit(DIR_TO_THING, &rsp, sizeof(rsp.action));
+}
+
+/* Echoes the sample answered, so the thing can match it exactly */
+static void send_push_result(const knot_msg_data *data, int8_t result)
+{
+	knot_thing_msg_push_rsp rsp;
+	uint8_t len = data->hdr.payload_len;
+
+	if (len > sizeof(rsp) - sizeof(rsp.hdr) - sizeof(rsp.result))
+		len = 0;
+
+	rsp.hdr.type = KNOT_MSG_PUSH_DATA_RSP;
+	rsp.hdr.payload_len = sizeof(rsp.result) + len;
+	rsp.result = result;
+	memcpy(&rsp.sensor_id, &data->sensor_id, len);
+	transmit(DIR_TO_THING, &rsp, sizeof(rsp.hdr) + rsp.hdr.payload_len);
+}
+
+static void send_credentials(void)
+{
+	knot_msg rsp;
+
+	memset(&rsp, 0, sizeof(rsp));
+	rsp.cred.hdr.type = KNOT_MSG_REG_RSP;
+	rsp.cred.hdr.payload_len = sizeof(rsp.cred) - sizeof(rsp.cred.hdr);
+	rsp.cred.result = 0;
+	memcpy(rsp.cred.uuid, gw_uuid, KNOT_PROTOCOL_UUID_LEN);
+	memcpy(rsp.cred.token, gw_token, KNOT_PROTOCOL_TOKEN_LEN);
+	transmit(DIR_TO_THING, &rsp, sizeof(rsp.cred));
+}
+
+static void handle_msg(const knot_msg *msg)
+{
+	if (msg_func)
+		msg_func(msg);
+
+	switch (msg->hdr.type) {
+	case KNOT_MSG_REG_REQ:
+		stats.registers++;
+		send_credentials();
+		break;
+	case KNOT_MSG_AUTH_REQ:
+		stats.auths++;
+		send_result(KNOT_MSG_AUTH_RSP, 0);
+		break;
+	case KNOT_MSG_SCHM_FRAG_REQ:
+		stats.schema_frags++;
+		send_result(KNOT_MSG_SCHM_FRAG_RSP, 0);
+		break;
+	case KNOT_MSG_SCHM_END_REQ:
+		stats.schema_ends++;
+		send_result(KNOT_MSG_SCHM_END_RSP, 0);
+		break;
+	case KNOT_MSG_PUSH_DATA_REQ:
+		stats.pushes++;
+		send_push_result(&msg->data, 0);
+		break;
+	case KNOT_MSG_PUSH_DELTA_REQ:
+		stats.deltas++;
+		send_push_result(&msg->data, 0);
+		break;
+	case KNOT_MSG_PUSH_AGED_REQ:
+		stats.aged++;
+		break;
+	case KNOT_MSG_PUSH_CONFIG_RSP:
+		stats.config_rsps++;
+		break;
+	default:
+		stats.others++;
+		break;
+	}
+}
+
+/* A frame may carry several messages back to back */
+static void handle_frame(const uint8_t *buf, uint16_t len)
+{
+	const knot_msg *msg;
+	uint16_t msg_len;
+
+	while (len >= sizeof(msg->hdr)) {
+		msg = (const knot_msg *) buf;
+		msg_len = sizeof(msg->hdr) + msg->hdr.payload_len;
+		if (msg_len > len)
+			break;
+
+		handle_msg(msg);
+		buf += msg_len;
+		len -= msg_len;
+	}
+}
+
+/* Deliver due frames in order; frames to the gateway get answered */
+static int line_flush(void)
+{
+	struct gw_frame frame;
+	uint64_t now = sim_time_us();
+	int handled = 0;
+	uint8_t i;
+
+	i = 0;
+	while (i < line_count) {
+		if (line[i].due_us > now) {
+			i++;
+			continue;
+		}
+
+		frame = line[i];
+		memmove(&line[i], &line[i + 1],
+				(line_count - i - 1) * sizeof(line[0]));
+		line_count--;
+
+		if (frame.dir == DIR_TO_THING) {
+			sim_link_send(frame.buf, frame.len);
+			continue;
+		}
+
+		handle_frame(frame.buf, frame.len);
+		handled++;
+		/* Answers may already be due: rescan from the start */
+		i = 0;
+	}
+
+	return handled;
+}
+
+static void line_reset(void)
+{
+	line_count = 0;
+	last_due[DIR_TO_GW] = 0;
+	last_due[DIR_TO_THING] = 0;
+}
+
+void gw_init(uint32_t seed)
+{
+	memset(&stats, 0, sizeof(stats));
+	memset(&faults, 0, sizeof(faults));
+	rand_state = seed ? seed : 1;
+	listen_us = 0;
+	flap_us = 0;
+	msg_func = NULL;
+	line_reset();
+}
+
+void gw_set_faults(const struct gw_faults *new_faults)
+{
+	faults = *new_faults;
+	if (faults.loss > 100)
+		faults.loss = 100;
+	if (faults.duplicate > 100)
+		faults.duplicate = 100;
+}
+
+void gw_get_faults(struct gw_faults *out)
+{
+	*out = faults;
+}
+
+void gw_disconnect(void)
+{
+	if (!sim_link_connected())
+		return;
+
+	stats.disconnects++;
+	sim_link_disconnect();
+	/* Frames in the air are lost with the link */
+	line_reset();
+	flap_us = 0;
+}
+
+int gw_process(void)
+{
+	uint8_t buf[SIM_FRAME_MAX];
+	uint64_t now = sim_time_us();
+	ssize_t len;
+
+	if (sim_link_listening() && !sim_link_connected()) {
+		if (listen_us == 0)
+			listen_us = now + 1;
+
+		if (now - (listen_us - 1) >= (uint64_t) faults.scan_ms * 1000 &&
+						sim_link_connect() == 0) {
+			stats.connects++;
+			listen_us = 0;
+		}
+	}
+
+	/* Link drops are scheduled once the thing accepted the link */
+	if (!sim_link_connected())
+		flap_us = 0;
+	else if (faults.flap_ms && flap_us == 0)
+		flap_us = now + 1 + (gw_random() %
+				(2 * (uint64_t) faults.flap_ms * 1000));
+	else if (flap_us && now >= flap_us)
+		gw_disconnect();
+
+	while ((len = sim_link_recv(buf, sizeof(buf))) > 0)
+		transmit(DIR_TO_GW, buf, len);
+
+	return line_flush();
+}
+
+void gw_get_stats(struct gw_stats *out)
+{
+	*out = stats;
+}
+
+void gw_set_msg_func(gw_msg_func func)
+{
+	msg_func = func;
+}
+
+void gw_send(const void *msg, size_t len)
+{
+	transmit(DIR_TO_THING, msg, len);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Minimal KNoT gateway running on the gateway side of the simulated
+ * link: accepts the thing, hands out credentials and acknowledges
+ * schemas and data. Frames in both directions go through a fault model
+ * (loss, duplication, latency) and the link can be dropped on demand.
+ */
+
+#ifndef __HOST_GATEWAY_H__
+#define __HOST_GATEWAY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "knot_protocol.h"
+
+struct gw_faults {
+	uint8_t loss;			/* % of frames dropped, per direction */
+	uint8_t duplicate;		/* % of frames delivered twice */
+	uint32_t delay_ms;		/* One way latency */
+	uint32_t jitter_ms;		/* Extra random latency, order kept */
+	uint32_t scan_ms;		/* Time to notice a listening thing */
+	uint32_t flap_ms;		/* Mean time between link drops, 0: off */
+};
+
+struct gw_stats {
+	uint32_t connects;
+	uint32_t disconnects;
+	uint32_t dropped;
+	uint32_t duplicated;
+	uint32_t registers;
+	uint32_t auths;
+	uint32_t schema_frags;
+	uint32_t schema_ends;
+	uint32_t pushes;
+	uint32_t deltas;
+	uint32_t aged;
+	uint32_t config_rsps;
+	uint32_t others;
+};
+
+void gw_init(uint32_t seed);
+void gw_set_faults(const struct gw_faults *faults);
+void gw_get_faults(struct gw_faults *faults);
+
+/* Accept the thing if it is listening and answer pending frames */
+int gw_process(void);
+
+/* Drop the link: the thing gets MGMT_EVT_NRF24_DISCONNECTED */
+void gw_disconnect(void);
+
+void gw_get_stats(struct gw_stats *stats);
+
+/* Called with every message from the thing, before it is answered */
+typedef void (*gw_msg_func)(const knot_msg *msg);
+void gw_set_msg_func(gw_msg_func func);
+
+/* Send a message to the thing, through the fault model */
+void gw_send(const void *msg, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOST_GATEWAY_H__ */
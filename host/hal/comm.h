@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host simulation of the KNoT HAL comm API. Mirrors the knot-hal-source
+ * declarations used by the thing; frames are exchanged in-process with
+ * the gateway side declared in sim.h.
+ */
+
+#ifndef __HAL_COMM_H__
+#define __HAL_COMM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Protocol family */
+#define HAL_COMM_PF_NRF24		1
+
+/* Transport protocol */
+#define HAL_COMM_PROTO_MGMT		0
+#define HAL_COMM_PROTO_RAW		1
+
+int hal_comm_init(const char *pathname, const void *params);
+int hal_comm_deinit(void);
+
+int hal_comm_socket(int domain, int protocol);
+void hal_comm_close(int sockfd);
+
+ssize_t hal_comm_read(int sockfd, void *buffer, size_t count);
+ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count);
+
+int hal_comm_listen(int sockfd);
+int hal_comm_accept(int sockfd, void *addr);
+int hal_comm_connect(int sockfd, uint64_t *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_COMM_H__ */
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* Host simulation of the KNoT HAL AVR GPIO API */
+
+#ifndef __HAL_GPIO_AVR_H__
+#define __HAL_GPIO_AVR_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#ifndef LOW
+#define LOW				0
+#define HIGH				1
+#endif
+
+#ifndef INPUT
+#define INPUT				0
+#define OUTPUT				1
+#define INPUT_PULLUP			2
+#endif
+
+int hal_gpio_setup(void);
+void hal_gpio_unmap(void);
+void hal_gpio_pin_mode(uint8_t gpio, uint8_t mode);
+void hal_gpio_digital_write(uint8_t gpio, uint8_t value);
+int hal_gpio_digital_read(uint8_t gpio);
+int hal_gpio_analog_read(uint8_t gpio);
+void hal_gpio_analog_reference(uint8_t type);
+void hal_gpio_analog_write(uint8_t gpio, int value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_GPIO_AVR_H__ */
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* Host logging: strings are dropped unless the simulation enables them */
+
+#ifndef __HAL_LINUX_LOG_H__
+#define __HAL_LINUX_LOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hal_log_str(const char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_LINUX_LOG_H__ */
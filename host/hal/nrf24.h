@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* nRF24 definitions used by the thing, mirroring knot-hal-source */
+
+#ifndef __HAL_NRF24_H__
+#define __HAL_NRF24_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Largest payload carried by a single nRF24 frame */
+#define NRF24_MTU			32
+
+/* Management events */
+#define MGMT_EVT_NRF24_CONNECTED	0x0200
+#define MGMT_EVT_NRF24_DISCONNECTED	0x0201
+
+struct nrf24_mac {
+	union {
+		uint8_t b[8];
+		uint64_t uint64;
+	} address;
+} __attribute__ ((packed));
+
+struct nrf24_config {
+	struct nrf24_mac mac;
+	uint8_t channel;
+	const char *name;
+	uint64_t id;
+};
+
+struct mgmt_nrf24_header {
+	uint16_t opcode;
+	uint8_t index;
+	uint8_t payload[0];
+} __attribute__ ((packed));
+
+int nrf24_mac2str(const struct nrf24_mac *mac, char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_NRF24_H__ */
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/* Host simulation of the KNoT HAL storage API (RAM backed EEPROM) */
+
+#ifndef __HAL_STORAGE_H__
+#define __HAL_STORAGE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HAL_STORAGE_ID_UUID		1
+#define HAL_STORAGE_ID_TOKEN		2
+#define HAL_STORAGE_ID_MAC		3
+#define HAL_STORAGE_ID_SCHEMA_FLAG	4
+
+ssize_t hal_storage_read(uint16_t addr, uint8_t *value, size_t len);
+ssize_t hal_storage_write(uint16_t addr, const uint8_t *value, size_t len);
+
+ssize_t hal_storage_read_end(uint8_t id, void *value, size_t len);
+ssize_t hal_storage_write_end(uint8_t id, void *value, size_t len);
+void hal_storage_reset_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_STORAGE_H__ */
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Host simulation of the KNoT HAL time API. Time is virtual: it only
+ * moves when the thing delays or when the simulation advances it.
+ */
+
+#ifndef __HAL_TIME_H__
+#define __HAL_TIME_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+void hal_delay_ms(uint32_t ms);
+void hal_delay_us(uint32_t us);
+uint32_t hal_time_ms(void);
+uint32_t hal_time_us(void);
+int hal_timeout(uint32_t current, uint32_t start, uint32_t timeout);
+int hal_getrandom(void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HAL_TIME_H__ */
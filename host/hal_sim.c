@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * In-process implementation of the HAL used by the thing core: virtual
+ * clock, RAM backed storage, GPIO latches and a single nRF24-like link
+ * whose remote end is driven through sim.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <hal/comm.h>
+#include <hal/storage.h>
+#include <hal/time.h>
+#include <hal/gpio_avr.h>
+#include <hal/nrf24.h>
+#include <hal/linux_log.h>
+#include "sim.h"
+
+/* Frames buffered in each direction of the link */
+#define SIM_QUEUE_LEN			32
+
+/* Simulated ATmega328 EEPROM and HAL "end" records */
+#define SIM_EEPROM_SIZE			1024
+#define SIM_STORAGE_IDS			8
+#define SIM_STORAGE_ID_SIZE		64
+
+#define SIM_GPIO_MAX			32
+
+/* Socket descriptors handed to the thing */
+#define SIM_SOCK_MGMT			1
+#define SIM_SOCK_CLI			2
+
+struct sim_queue {
+	uint8_t frame[SIM_QUEUE_LEN][SIM_FRAME_MAX];
+	uint16_t len[SIM_QUEUE_LEN];
+	uint8_t head;
+	uint8_t count;
+};
+
+static uint64_t now_us;
+static uint32_t rand_state;
+static int log_enabled;
+
+static uint8_t eeprom[SIM_EEPROM_SIZE];
+static uint8_t storage_end[SIM_STORAGE_IDS][SIM_STORAGE_ID_SIZE];
+
+static uint8_t gpio_mode[SIM_GPIO_MAX];
+static uint8_t gpio_value[SIM_GPIO_MAX];
+
+static struct sim_queue to_thing, to_gw;
+static uint16_t mgmt_pending;
+static int initialized, listening, connect_pending, connected;
+static uint32_t fail_writes;
+static struct sim_comm_stats stats;
+
+static void queue_reset(struct sim_queue *q)
+{
+	q->head = 0;
+	q->count = 0;
+}
+
+static int queue_put(struct sim_queue *q, const void *buf, size_t len)
+{
+	uint8_t tail;
+
+	if (len > SIM_FRAME_MAX)
+		return -EMSGSIZE;
+
+	if (q->count == SIM_QUEUE_LEN)
+		return -ENOBUFS;
+
+	tail = (q->head + q->count) % SIM_QUEUE_LEN;
+	memcpy(q->frame[tail], buf, len);
+	q->len[tail] = len;
+	q->count++;
+
+	return len;
+}
+
+static ssize_t queue_get(struct sim_queue *q, void *buf, size_t len)
+{
+	size_t flen;
+
+	if (q->count == 0)
+		return -EAGAIN;
+
+	flen = q->len[q->head];
+	if (flen > len)
+		flen = len;
+
+	memcpy(buf, q->frame[q->head], flen);
+	q->head = (q->head + 1) % SIM_QUEUE_LEN;
+	q->count--;
+
+	return flen;
+}
+
+void sim_reset(uint32_t seed)
+{
+	sim_storage_clear();
+	sim_power_cycle(seed);
+}
+
+void sim_power_cycle(uint32_t seed)
+{
+	now_us = 0;
+	rand_state = seed ? seed : 1;
+	memset(gpio_mode, 0, sizeof(gpio_mode));
+	memset(gpio_value, 0, sizeof(gpio_value));
+	queue_reset(&to_thing);
+	queue_reset(&to_gw);
+	mgmt_pending = 0;
+	initialized = 0;
+	listening = 0;
+	connect_pending = 0;
+	connected = 0;
+	fail_writes = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* Clock */
+
+uint64_t sim_time_us(void)
+{
+	return now_us;
+}
+
+void sim_time_advance_us(uint32_t us)
+{
+	now_us += us;
+}
+
+void sim_time_advance_ms(uint32_t ms)
+{
+	now_us += (uint64_t) ms * 1000;
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+	sim_time_advance_ms(ms);
+}
+
+void hal_delay_us(uint32_t us)
+{
+	sim_time_advance_us(us);
+}
+
+uint32_t hal_time_ms(void)
+{
+	return (uint32_t) (now_us / 1000);
+}
+
+uint32_t hal_time_us(void)
+{
+	return (uint32_t) now_us;
+}
+
+int hal_timeout(uint32_t current, uint32_t start, uint32_t timeout)
+{
+	return (current - start) >= timeout;
+}
+
+int hal_getrandom(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	size_t i;
+
+	/* xorshift32: deterministic per sim_reset() seed */
+	for (i = 0; i < len; i++) {
+		rand_state ^= rand_state << 13;
+		rand_state ^= rand_state >> 17;
+		rand_state ^= rand_state << 5;
+		p[i] = rand_state;
+	}
+
+	return 0;
+}
+
+/* Storage */
+
+void sim_storage_clear(void)
+{
+	memset(eeprom, 0xff, sizeof(eeprom));
+	memset(storage_end, 0, sizeof(storage_end));
+}
+
+ssize_t hal_storage_read(uint16_t addr, uint8_t *value, size_t len)
+{
+	if ((size_t) addr + len > sizeof(eeprom))
+		return -EINVAL;
+
+	memcpy(value, eeprom + addr, len);
+
+	return len;
+}
+
+ssize_t hal_storage_write(uint16_t addr, const uint8_t *value, size_t len)
+{
+	if ((size_t) addr + len > sizeof(eeprom))
+		return -EINVAL;
+
+	memcpy(eeprom + addr, value, len);
+
+	return len;
+}
+
+ssize_t hal_storage_read_end(uint8_t id, void *value, size_t len)
+{
+	if (id >= SIM_STORAGE_IDS || len > SIM_STORAGE_ID_SIZE)
+		return -EINVAL;
+
+	memcpy(value, storage_end[id], len);
+
+	return len;
+}
+
+ssize_t hal_storage_write_end(uint8_t id, void *value, size_t len)
+{
+	if (id >= SIM_STORAGE_IDS || len > SIM_STORAGE_ID_SIZE)
+		return -EINVAL;
+
+	memcpy(storage_end[id], value, len);
+
+	return len;
+}
+
+void hal_storage_reset_end(void)
+{
+	memset(storage_end, 0, sizeof(storage_end));
+}
+
+/* GPIO */
+
+int hal_gpio_setup(void)
+{
+	return 0;
+}
+
+void hal_gpio_unmap(void)
+{
+}
+
+void hal_gpio_pin_mode(uint8_t gpio, uint8_t mode)
+{
+	if (gpio >= SIM_GPIO_MAX)
+		return;
+
+	gpio_mode[gpio] = mode;
+	/* Pull-ups read high until something drives the pin */
+	if (mode == INPUT_PULLUP)
+		gpio_value[gpio] = HIGH;
+}
+
+void hal_gpio_digital_write(uint8_t gpio, uint8_t value)
+{
+	if (gpio < SIM_GPIO_MAX)
+		gpio_value[gpio] = value;
+}
+
+int hal_gpio_digital_read(uint8_t gpio)
+{
+	if (gpio >= SIM_GPIO_MAX)
+		return LOW;
+
+	return gpio_value[gpio];
+}
+
+int hal_gpio_analog_read(uint8_t gpio)
+{
+	return hal_gpio_digital_read(gpio) ? 1023 : 0;
+}
+
+void hal_gpio_analog_reference(uint8_t type)
+{
+}
+
+void hal_gpio_analog_write(uint8_t gpio, int value)
+{
+	hal_gpio_digital_write(gpio, value ? HIGH : LOW);
+}
+
+void sim_gpio_set(uint8_t gpio, uint8_t value)
+{
+	hal_gpio_digital_write(gpio, value);
+}
+
+uint8_t sim_gpio_get(uint8_t gpio)
+{
+	return hal_gpio_digital_read(gpio);
+}
+
+/* Log */
+
+void sim_log_enable(int enable)
+{
+	log_enabled = enable;
+}
+
+void hal_log_str(const char *str)
+{
+	if (log_enabled)
+		fprintf(stderr, "[%10llu] %s\n",
+			(unsigned long long) (now_us / 1000), str);
+}
+
+int nrf24_mac2str(const struct nrf24_mac *mac, char *str)
+{
+	return sprintf(str, "%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X",
+		mac->address.b[7], mac->address.b[6], mac->address.b[5],
+		mac->address.b[4], mac->address.b[3], mac->address.b[2],
+		mac->address.b[1], mac->address.b[0]);
+}
+
+/* Comm: thing side */
+
+int hal_comm_init(const char *pathname, const void *params)
+{
+	initialized = 1;
+
+	return 0;
+}
+
+int hal_comm_deinit(void)
+{
+	initialized = 0;
+	listening = 0;
+	connected = 0;
+
+	return 0;
+}
+
+int hal_comm_socket(int domain, int protocol)
+{
+	if (!initialized || domain != HAL_COMM_PF_NRF24)
+		return -EINVAL;
+
+	return SIM_SOCK_MGMT;
+}
+
+void hal_comm_close(int sockfd)
+{
+	if (sockfd != SIM_SOCK_CLI)
+		return;
+
+	connected = 0;
+	queue_reset(&to_thing);
+	queue_reset(&to_gw);
+}
+
+ssize_t hal_comm_read(int sockfd, void *buffer, size_t count)
+{
+	struct mgmt_nrf24_header *mhdr = buffer;
+	ssize_t len;
+
+	stats.reads++;
+
+	if (sockfd == SIM_SOCK_MGMT) {
+		if (mgmt_pending == 0 || count < sizeof(*mhdr))
+			return -EAGAIN;
+
+		mhdr->opcode = mgmt_pending;
+		mhdr->index = 0;
+		mgmt_pending = 0;
+
+		return sizeof(*mhdr);
+	}
+
+	if (sockfd != SIM_SOCK_CLI || !connected)
+		return -ENOTCONN;
+
+	len = queue_get(&to_thing, buffer, count);
+	if (len > 0)
+		stats.frames_to_thing++;
+
+	return len;
+}
+
+ssize_t hal_comm_write(int sockfd, const void *buffer, size_t count)
+{
+	ssize_t len;
+
+	stats.writes++;
+
+	if (sockfd != SIM_SOCK_CLI || !connected)
+		return -ENOTCONN;
+
+	if (fail_writes) {
+		fail_writes--;
+		stats.write_errors++;
+		return -EAGAIN;
+	}
+
+	len = queue_put(&to_gw, buffer, count);
+	if (len > 0)
+		stats.frames_to_gw++;
+
+	return len;
+}
+
+int hal_comm_listen(int sockfd)
+{
+	if (sockfd != SIM_SOCK_MGMT)
+		return -EINVAL;
+
+	listening = 1;
+
+	return 0;
+}
+
+int hal_comm_accept(int sockfd, void *addr)
+{
+	if (sockfd != SIM_SOCK_MGMT || !listening)
+		return -EINVAL;
+
+	if (!connect_pending)
+		return -EAGAIN;
+
+	connect_pending = 0;
+	connected = 1;
+	mgmt_pending = 0;
+	queue_reset(&to_thing);
+	queue_reset(&to_gw);
+
+	return SIM_SOCK_CLI;
+}
+
+int hal_comm_connect(int sockfd, uint64_t *addr)
+{
+	return -ENOSYS;
+}
+
+/* Comm: gateway side */
+
+int sim_link_listening(void)
+{
+	return listening;
+}
+
+int sim_link_connected(void)
+{
+	return connected;
+}
+
+int sim_link_connect(void)
+{
+	if (!listening || connected)
+		return -EAGAIN;
+
+	if (connect_pending)
+		return -EALREADY;
+
+	connect_pending = 1;
+
+	return 0;
+}
+
+void sim_link_disconnect(void)
+{
+	if (!connected)
+		return;
+
+	connected = 0;
+	mgmt_pending = MGMT_EVT_NRF24_DISCONNECTED;
+	queue_reset(&to_thing);
+	queue_reset(&to_gw);
+}
+
+int sim_link_send(const void *buf, size_t len)
+{
+	if (!connected)
+		return -ENOTCONN;
+
+	return queue_put(&to_thing, buf, len);
+}
+
+ssize_t sim_link_recv(void *buf, size_t len)
+{
+	return queue_get(&to_gw, buf, len);
+}
+
+void sim_link_fail_writes(uint32_t count)
+{
+	fail_writes = count;
+}
+
+void sim_link_stats(struct sim_comm_stats *out)
+{
+	*out = stats;
+}
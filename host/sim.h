@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Control side of the simulated HAL. The thing only sees the regular
+ * hal/ API; host programs use these functions to drive the virtual clock
+ * and to play the gateway end of the radio link.
+ */
+
+#ifndef __HOST_SIM_H__
+#define __HOST_SIM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Largest frame accepted by the simulated link */
+#define SIM_FRAME_MAX			256
+
+struct sim_comm_stats {
+	uint32_t reads;			/* hal_comm_read() calls */
+	uint32_t writes;		/* hal_comm_write() calls */
+	uint32_t frames_to_gw;		/* Frames written by the thing */
+	uint32_t frames_to_thing;	/* Frames delivered to the thing */
+	uint32_t write_errors;		/* Injected write failures */
+};
+
+/* Reset clock, link, storage and GPIO to power-on state */
+void sim_reset(uint32_t seed);
+
+/* Same as sim_reset() but storage (credentials, flags) survives */
+void sim_power_cycle(uint32_t seed);
+
+/* Virtual clock */
+uint64_t sim_time_us(void);
+void sim_time_advance_us(uint32_t us);
+void sim_time_advance_ms(uint32_t ms);
+
+/* Link: gateway side */
+int sim_link_listening(void);
+int sim_link_connected(void);
+int sim_link_connect(void);
+void sim_link_disconnect(void);
+int sim_link_send(const void *buf, size_t len);
+ssize_t sim_link_recv(void *buf, size_t len);
+void sim_link_fail_writes(uint32_t count);
+void sim_link_stats(struct sim_comm_stats *stats);
+
+/* Storage and GPIO */
+void sim_storage_clear(void);
+void sim_gpio_set(uint8_t gpio, uint8_t value);
+uint8_t sim_gpio_get(uint8_t gpio);
+
+/* Print hal_log_str() output to stderr */
+void sim_log_enable(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOST_SIM_H__ */
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Runs an example sketch linked with it against the simulated gateway:
+ * setup() once, then loop() on the virtual clock. Prints the schema the
+ * gateway got and fails if the thing didn't get online or sent an item
+ * without a name.
+ *
+ * Usage: <sketch> [-s seconds] [-v]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "KNoTThing.h"
+#include "sim.h"
+#include "gateway.h"
+
+void setup(void);
+void loop(void);
+
+static int schema_items, unnamed_items;
+
+static void gw_msg(const knot_msg *msg)
+{
+	const knot_schema *values = &msg->schema.values;
+
+	/* The last item goes in the end fragment */
+	if (msg->hdr.type != KNOT_MSG_SCHM_FRAG_REQ &&
+			msg->hdr.type != KNOT_MSG_SCHM_END_REQ)
+		return;
+
+	printf("schema %u \"%.*s\" type 0x%04x value type %u unit %u\n",
+		msg->schema.sensor_id, (int) sizeof(values->name),
+		values->name, values->type_id, values->value_type,
+		values->unit);
+
+	schema_items++;
+	if (values->name[0] == '\0')
+		unnamed_items++;
+}
+
+int main(int argc, char *argv[])
+{
+	struct gw_stats stats;
+	uint64_t end;
+	int opt, seconds = 30;
+
+	while ((opt = getopt(argc, argv, "s:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'v':
+			sim_log_enable(1);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds] [-v]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	sim_reset(1);
+	gw_init(1);
+	gw_set_msg_func(gw_msg);
+
+	setup();
+
+	end = (uint64_t) seconds * 1000000;
+	while (sim_time_us() < end) {
+		loop();
+		gw_process();
+		sim_time_advance_ms(1);
+	}
+
+	gw_get_stats(&stats);
+	printf("%s: %u schema items, %u data pushes\n",
+		knot_thing_protocol_state() == STATE_RUNNING ?
+		"online" : "offline", schema_items, stats.pushes);
+
+	if (knot_thing_protocol_state() != STATE_RUNNING ||
+				schema_items == 0 || unnamed_items)
+		return 2;
+
+	return 0;
+}
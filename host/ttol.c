@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2018, CESAR.
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license. See the LICENSE file for details.
+ *
+ */
+
+/*
+ * Time-to-online: boots the thing repeatedly against the simulated
+ * gateway under injected faults and reports the distribution of the
+ * virtual time from knot_thing_init() to STATE_RUNNING.
+ *
+ * Faults are set from the command line and may be changed during each
+ * run by a script; one event per line, times relative to init:
+ *
+ *	# ms	command		arguments
+ *	0	loss		20
+ *	0	delay		15 5		(delay_ms jitter_ms)
+ *	0	dup		5
+ *	0	scan		200
+ *	0	flap		3000		(mean ms between link drops)
+ *	2500	disconnect
+ *	8000	loss		0
+ *
+ * By default the thing is provisioned once and every run reboots it with
+ * the stored credentials (auth path). Use -c to wipe storage before each
+ * run (register and schema path).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "knot_thing_main.h"
+#include "knot_thing_config.h"
+#include "sim.h"
+#include "gateway.h"
+
+#define SCRIPT_MAX			64
+
+#define CMD_LOSS			0
+#define CMD_DUP				1
+#define CMD_DELAY			2
+#define CMD_SCAN			3
+#define CMD_FLAP			4
+#define CMD_DISCONNECT			5
+
+struct script_event {
+	uint32_t at_ms;
+	uint8_t cmd;
+	uint32_t arg[2];
+};
+
+static const char *cmd_names[] = {
+	"loss", "dup", "delay", "scan", "flap", "disconnect"
+};
+
+static struct script_event script[SCRIPT_MAX];
+static uint8_t script_len;
+
+/* "Sensor N" for every slot the build has */
+static char item_names[KNOT_THING_DATA_MAX][16];
+
+static int sensor_read(int32_t *val)
+{
+	*val = (int32_t) (sim_time_us() / 1000000);
+
+	return 0;
+}
+
+static int script_load(const char *path)
+{
+	struct script_event *ev;
+	char line[128], cmd[16];
+	unsigned long at, a0, a1;
+	unsigned int i;
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		a0 = a1 = 0;
+		n = sscanf(line, "%lu %15s %lu %lu", &at, cmd, &a0, &a1);
+		if (n < 2)
+			continue;
+
+		for (i = 0; i < sizeof(cmd_names) / sizeof(cmd_names[0]); i++)
+			if (strcmp(cmd, cmd_names[i]) == 0)
+				break;
+
+		if (i == sizeof(cmd_names) / sizeof(cmd_names[0]) ||
+						script_len == SCRIPT_MAX) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			fclose(fp);
+			return -1;
+		}
+
+		ev = &script[script_len++];
+		ev->at_ms = at;
+		ev->cmd = i;
+		ev->arg[0] = a0;
+		ev->arg[1] = a1;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static void script_apply(const struct script_event *ev)
+{
+	struct gw_faults faults;
+
+	gw_get_faults(&faults);
+
+	switch (ev->cmd) {
+	case CMD_LOSS:
+		faults.loss = ev->arg[0];
+		break;
+	case CMD_DUP:
+		faults.duplicate = ev->arg[0];
+		break;
+	case CMD_DELAY:
+		faults.delay_ms = ev->arg[0];
+		faults.jitter_ms = ev->arg[1];
+		break;
+	case CMD_SCAN:
+		faults.scan_ms = ev->arg[0];
+		break;
+	case CMD_FLAP:
+		faults.flap_ms = ev->arg[0];
+		break;
+	case CMD_DISCONNECT:
+		gw_disconnect();
+		return;
+	}
+
+	gw_set_faults(&faults);
+}
+
+static int register_items(int items)
+{
+	knot_data_functions func;
+	int i;
+
+	func.int_f.read = sensor_read;
+	func.int_f.write = NULL;
+
+	for (i = 0; i < items; i++) {
+		if (knot_thing_register_data_item(i + 1, item_names[i],
+				KNOT_TYPE_ID_SPEED, KNOT_VALUE_TYPE_INT,
+				KNOT_UNIT_SPEED_MS, &func) < 0)
+			return i;
+	}
+
+	return i;
+}
+
+/* Boot the thing and run it until online; returns virtual ms or -1 */
+static int64_t bring_up(int items, uint32_t tick_us, uint32_t timeout_ms,
+						const struct gw_faults *faults)
+{
+	uint32_t elapsed_ms;
+	uint8_t next = 0;
+
+	gw_set_faults(faults);
+	knot_thing_init("KNoT TTOL");
+	register_items(items);
+
+	for (elapsed_ms = 0; elapsed_ms < timeout_ms;
+				elapsed_ms = sim_time_us() / 1000) {
+		while (next < script_len && script[next].at_ms <= elapsed_ms)
+			script_apply(&script[next++]);
+
+		knot_thing_run();
+		gw_process();
+
+		if (knot_thing_protocol_state() == STATE_RUNNING)
+			return sim_time_us() / 1000;
+
+		sim_time_advance_us(tick_us);
+	}
+
+	return -1;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static uint32_t percentile(const uint32_t *sorted, uint32_t count, int pct)
+{
+	uint32_t rank = (count * pct + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -r runs        number of boots (100)\n"
+		"  -n items       registered items (%d)\n"
+		"  -c             wipe storage before each run (register)\n"
+		"  -l pct         frame loss per direction\n"
+		"  -u pct         duplicated frames\n"
+		"  -d ms          one way delay\n"
+		"  -j ms          delay jitter\n"
+		"  -S ms          gateway scan time\n"
+		"  -F ms          mean time between link drops\n"
+		"  -f file        fault script\n"
+		"  -t us          thing loop period (1000)\n"
+		"  -T s           give up after (600)\n"
+		"  -s seed        random seed (1)\n"
+		"  -v             print every run\n",
+		prog, KNOT_THING_DATA_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+	struct gw_faults faults;
+	struct gw_stats gw, total;
+	uint32_t *times;
+	uint32_t runs = 100, seed = 1, tick_us = 1000, timeout_s = 600;
+	uint32_t run, online = 0;
+	uint64_t sum = 0;
+	int64_t ms;
+	int items = KNOT_THING_DATA_MAX, cold = 0, verbose = 0, opt, i;
+
+	memset(&faults, 0, sizeof(faults));
+	memset(&total, 0, sizeof(total));
+
+	while ((opt = getopt(argc, argv, "r:n:cl:u:d:j:S:F:f:t:T:s:vh")) != -1) {
+		switch (opt) {
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			items = atoi(optarg);
+			break;
+		case 'c':
+			cold = 1;
+			break;
+		case 'l':
+			faults.loss = atoi(optarg);
+			break;
+		case 'u':
+			faults.duplicate = atoi(optarg);
+			break;
+		case 'd':
+			faults.delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			faults.jitter_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			faults.scan_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			faults.flap_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (script_load(optarg) < 0)
+				return 1;
+			break;
+		case 't':
+			tick_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			timeout_s = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (runs == 0 || tick_us == 0 || items < 1 ||
+						items > KNOT_THING_DATA_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < items; i++)
+		snprintf(item_names[i], sizeof(item_names[i]), "Sensor %d",
+									i + 1);
+
+	times = calloc(runs, sizeof(*times));
+	if (!times)
+		return 1;
+
+	sim_reset(seed);
+
+	/* Provision credentials and schema once, without faults */
+	if (!cold) {
+		struct gw_faults clean;
+		uint8_t saved = script_len;
+
+		memset(&clean, 0, sizeof(clean));
+		gw_init(seed);
+		script_len = 0;
+		if (bring_up(items, tick_us, timeout_s * 1000, &clean) < 0) {
+			fprintf(stderr, "provisioning failed\n");
+			return 1;
+		}
+		script_len = saved;
+		knot_thing_exit();
+	}
+
+	for (run = 0; run < runs; run++) {
+		if (cold)
+			sim_reset(seed + run);
+		else
+			sim_power_cycle(seed + run);
+
+		gw_init(seed + run);
+		ms = bring_up(items, tick_us, timeout_s * 1000, &faults);
+		knot_thing_exit();
+
+		gw_get_stats(&gw);
+		total.connects += gw.connects;
+		total.disconnects += gw.disconnects;
+		total.dropped += gw.dropped;
+		total.duplicated += gw.duplicated;
+		total.registers += gw.registers;
+		total.auths += gw.auths;
+		total.schema_frags += gw.schema_frags;
+		total.schema_ends += gw.schema_ends;
+
+		if (verbose)
+			printf("run %4u: %s%lld ms\n", run,
+				ms < 0 ? "timeout after " : "",
+				(long long) (ms < 0 ? timeout_s * 1000 : ms));
+
+		if (ms < 0)
+			continue;
+
+		times[online++] = ms;
+		sum += ms;
+	}
+
+	printf("runs               %u (%s)\n", runs,
+				cold ? "cold: register" : "warm: auth");
+	printf("faults             loss %u%% dup %u%% delay %u+%u ms "
+		"scan %u ms flap %u ms, %u script events\n",
+		faults.loss, faults.duplicate, faults.delay_ms,
+		faults.jitter_ms, faults.scan_ms, faults.flap_ms, script_len);
+	printf("online             %u of %u\n", online, runs);
+
+	if (online) {
+		qsort(times, online, sizeof(*times), cmp_u32);
+		printf("time to RUNNING    min %u  p50 %u  p99 %u  max %u  "
+			"mean %.1f ms\n", times[0],
+			percentile(times, online, 50),
+			percentile(times, online, 99), times[online - 1],
+			(double) sum / online);
+	}
+
+	printf("gateway            %u connects, %u drops, %u lost frames, "
+		"%u duplicated\n", total.connects, total.disconnects,
+		total.dropped, total.duplicated);
+	printf("handshake frames   %u reg, %u auth, %u schema frag, "
+		"%u schema end\n", total.registers, total.auths,
+		total.schema_frags, total.schema_ends);
+
+	free(times);
+
+	return online == runs ? 0 : 2;
+}
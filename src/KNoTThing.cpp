@@ -9,7 +9,9 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
 
+#include "knot_thing_config.h"
 #include "KNoTThing.h"
 
 KNoTThing::KNoTThing()
@@ -77,11 +79,55 @@ int KNoTThing::registerRawData(const char *name, uint8_t *raw_buffer,
 		raw_buffer_len, type_id, KNOT_VALUE_TYPE_RAW, unit, &func);
 }
 
+int KNoTThing::registerStats(const char *name, uint8_t sensor_id)
+{
+#if KNOT_THING_STATS
+	static uint8_t raw_buffer[sizeof(knot_thing_stats_raw)];
+
+	return registerRawData(name, raw_buffer, sizeof(raw_buffer), sensor_id,
+				KNOT_TYPE_ID_NONE, KNOT_UNIT_NOT_APPLICABLE,
+				knot_thing_stats_read, NULL);
+#else
+	return -1;
+#endif
+}
+
+int KNoTThing::completeIntRead(uint8_t sensor_id, int32_t value)
+{
+	return knot_thing_complete_read(sensor_id, &value, sizeof(value));
+}
+
+int KNoTThing::completeFloatRead(uint8_t sensor_id, float value)
+{
+	return knot_thing_complete_read(sensor_id, &value, sizeof(value));
+}
+
+int KNoTThing::completeBoolRead(uint8_t sensor_id, uint8_t value)
+{
+	return knot_thing_complete_read(sensor_id, &value, sizeof(value));
+}
+
+int KNoTThing::completeRawRead(uint8_t sensor_id, const uint8_t *buffer,
+								uint8_t len)
+{
+	return knot_thing_complete_read(sensor_id, buffer, len);
+}
+
+int KNoTThing::completeWrite(uint8_t sensor_id, int result)
+{
+	return knot_thing_complete_write(sensor_id, result);
+}
+
 void KNoTThing::run()
 {
 	knot_thing_run();
 }
 
+uint32_t KNoTThing::runTickless()
+{
+	return knot_thing_run_tickless();
+}
+
 int KNoTThing::registerDefaultConfig(uint8_t sensor_id, ...)
 {
 	va_list event_args;
@@ -92,9 +138,13 @@ int KNoTThing::registerDefaultConfig(uint8_t sensor_id, ...)
 	uint16_t time_sec = 0;
 	knot_value_type lower_limit;
 	knot_value_type upper_limit;
+	knot_thing_filter filter;
+	uint8_t filtered = 0;
+	int aggregate = -1;
 
 	lower_limit.val_i = 0;
 	upper_limit.val_i = 0;
+	memset(&filter, 0, sizeof(filter));
 
 	value_type = knot_thing_get_value_type(sensor_id);
 
@@ -133,6 +183,35 @@ int KNoTThing::registerDefaultConfig(uint8_t sensor_id, ...)
 							 double);
 			event_flags |= KNOT_EVT_FLAG_LOWER_THRESHOLD;
 			break;
+		case KNOT_THING_CFG_DEADBAND_PERCENT:
+			filter.flags |= KNOT_THING_FILTER_PERCENT;
+			/* fall through */
+		case KNOT_THING_CFG_DEADBAND:
+			if(value_type == KNOT_VALUE_TYPE_INT)
+				filter.deadband.val_i = (int32_t) va_arg(event_args,
+							 int);
+			if(value_type == KNOT_VALUE_TYPE_FLOAT)
+				filter.deadband.val_f = (float) va_arg(event_args,
+							 double);
+			filtered = 1;
+			break;
+		case KNOT_THING_CFG_HYSTERESIS:
+			if(value_type == KNOT_VALUE_TYPE_INT)
+				filter.hysteresis.val_i = (int32_t) va_arg(event_args,
+							 int);
+			if(value_type == KNOT_VALUE_TYPE_FLOAT)
+				filter.hysteresis.val_f = (float) va_arg(event_args,
+							 double);
+			filtered = 1;
+			break;
+		case KNOT_THING_CFG_MIN_INTERVAL:
+			filter.min_interval_ms = (uint16_t) va_arg(event_args,
+							 int);
+			filtered = 1;
+			break;
+		case KNOT_THING_CFG_AGGREGATE:
+			aggregate = (uint8_t) va_arg(event_args, int);
+			break;
 		default:
 			va_end(event_args);
 			return -1;
@@ -141,6 +220,18 @@ int KNoTThing::registerDefaultConfig(uint8_t sensor_id, ...)
 	} while(event);
 	va_end(event_args);
 
+	if (filtered && knot_thing_filter_data_item(sensor_id, &filter) < 0)
+		return -1;
+
+	if (aggregate >= 0 &&
+			knot_thing_aggregate_data_item(sensor_id, aggregate) < 0)
+		return -1;
+
 	return knot_thing_config_data_item(sensor_id, event_flags, time_sec,
 						&lower_limit, &upper_limit);
 }
+
+int KNoTThing::setPriority(uint8_t sensor_id, uint8_t priority)
+{
+	return knot_thing_set_item_priority(sensor_id, priority);
+}
@@ -10,9 +10,76 @@
 #ifndef __KNOTTHING_H__
 #define __KNOTTHING_H__
 
+#include <stddef.h>
+
 #include "knot_types.h"
+#include "knot_thing_config.h"
 #include "knot_thing_main.h"
 
+/*
+ * registerDefaultConfig() tags for the change filter, beside the
+ * KNOT_EVT_FLAG_* ones. Each takes a value of the item type, but
+ * KNOT_THING_CFG_MIN_INTERVAL that takes milliseconds and
+ * KNOT_THING_CFG_AGGREGATE that takes a KNOT_THING_AGG_* mode.
+ */
+#define KNOT_THING_CFG_DEADBAND		0x10
+#define KNOT_THING_CFG_DEADBAND_PERCENT	0x11
+#define KNOT_THING_CFG_HYSTERESIS	0x12
+#define KNOT_THING_CFG_MIN_INTERVAL	0x13
+#define KNOT_THING_CFG_AGGREGATE	0x14
+
+/* KNOT_VALUE_TYPE_* of the types registerData() takes */
+template <typename T> struct KNoTValueType;
+
+template <> struct KNoTValueType<int32_t> {
+	static const uint8_t value = KNOT_VALUE_TYPE_INT;
+};
+
+template <> struct KNoTValueType<float> {
+	static const uint8_t value = KNOT_VALUE_TYPE_FLOAT;
+};
+
+template <> struct KNoTValueType<uint8_t> {
+	static const uint8_t value = KNOT_VALUE_TYPE_BOOL;
+};
+
+/*
+ * Functions of an item served by member functions of C: one table per
+ * instantiation, the object being the item context.
+ */
+template <typename T, typename C, int (C::*Read)(T *), int (C::*Write)(T *)>
+struct KNoTMemberOps {
+	static int read(void *ctx, void *val)
+	{
+		return (static_cast<C *>(ctx)->*Read)(static_cast<T *>(val));
+	}
+
+	static int write(void *ctx, void *val)
+	{
+		return (static_cast<C *>(ctx)->*Write)(static_cast<T *>(val));
+	}
+
+	static const knot_ctx_ops ops;
+};
+
+template <typename T, typename C, int (C::*Read)(T *), int (C::*Write)(T *)>
+const knot_ctx_ops KNoTMemberOps<T, C, Read, Write>::ops = {
+	Read ? read : 0, Write ? write : 0
+};
+
+/* Functions of an item read by calling a functor, int operator()(T *) */
+template <typename T, typename F>
+struct KNoTFunctorOps {
+	static int read(void *ctx, void *val)
+	{
+		return (*static_cast<F *>(ctx))(static_cast<T *>(val));
+	}
+
+	static const knot_ctx_ops ops;
+};
+
+template <typename T, typename F>
+const knot_ctx_ops KNoTFunctorOps<T, F>::ops = { read, 0 };
 
 class KNoTThing {
 public:
@@ -43,9 +110,78 @@ public:
 			uint16_t type_id, uint8_t unit, rawReadFunction read,
 			rawWriteFunction write);
 
+	/*
+	 * Registers the runtime counters as a raw item so the gateway
+	 * collects them; needs KNOT_THING_STATS.
+	 */
+	int registerStats(const char *name, uint8_t sensor_id);
+
+	/*
+	 * Registers an item of type T (int32_t, float or uint8_t for
+	 * bool) read and written by member functions of obj, which must
+	 * outlive the thing. One object may serve several items; there
+	 * is no allocation and no switch on the type per call:
+	 *
+	 *	thing.registerData<int32_t, Scale, &Scale::read,
+	 *		&Scale::write>("Scale", 2, KNOT_TYPE_ID_MASS,
+	 *				KNOT_UNIT_MASS_G, scale);
+	 */
+	template <typename T, typename C, int (C::*Read)(T *),
+					int (C::*Write)(T *) = nullptr>
+	int registerData(const char *name, uint8_t sensor_id,
+			uint16_t type_id, uint8_t unit, C &obj)
+	{
+		return knot_thing_register_ctx_data_item(sensor_id, name,
+				type_id, KNoTValueType<T>::value, unit,
+				&KNoTMemberOps<T, C, Read, Write>::ops, &obj);
+	}
+
+	/* Same for a source read by a functor kept alive by the caller */
+	template <typename T, typename F>
+	int registerData(const char *name, uint8_t sensor_id,
+			uint16_t type_id, uint8_t unit, F &read)
+	{
+		return knot_thing_register_ctx_data_item(sensor_id, name,
+				type_id, KNoTValueType<T>::value, unit,
+				&KNoTFunctorOps<T, F>::ops, &read);
+	}
+
+	/*
+	 * Registers a const PROGMEM table of knot_thing_item_def; the
+	 * item count comes from the array and is checked at build time.
+	 */
+	template <size_t N>
+	int registerItems(const knot_thing_item_def (&table)[N])
+	{
+		static_assert(N <= KNOT_THING_DATA_MAX,
+				"more items than KNOT_THING_DATA_MAX");
+
+		return knot_thing_register_item_table(table, N);
+	}
+
 	int registerDefaultConfig(uint8_t sensor_id, ...);
 
+	/*
+	 * Complete a read or write function that returned
+	 * KNOT_THING_PENDING; need KNOT_THING_ASYNC.
+	 */
+	int completeIntRead(uint8_t sensor_id, int32_t value);
+	int completeFloatRead(uint8_t sensor_id, float value);
+	int completeBoolRead(uint8_t sensor_id, uint8_t value);
+	int completeRawRead(uint8_t sensor_id, const uint8_t *buffer,
+							uint8_t len);
+	int completeWrite(uint8_t sensor_id, int result);
+
+	/* Items with a higher priority are checked for events first */
+	int setPriority(uint8_t sensor_id, uint8_t priority);
+
 	void run();
+
+	/*
+	 * Runs like run() and returns the milliseconds until the next
+	 * scheduled work, so the caller can sleep instead of spinning.
+	 */
+	uint32_t runTickless();
 private:
 
 };
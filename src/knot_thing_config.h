@@ -7,5 +7,289 @@
  *
  */
 
-/* Use defined: Thing amount of data source/sinks */
+/*
+ * Use defined: Thing amount of data source/sinks, up to 255. Slots are
+ * static arrays sized by this, not allocated as items register: the core
+ * keeps off the heap, which on AVR shares 2 KB with the stack and the
+ * sketch. So every slot takes RAM even if unused; set this to the items
+ * the sketch registers. knot_thing_get_ram_usage() reports the cost.
+ */
+#ifndef KNOT_THING_DATA_MAX
 #define KNOT_THING_DATA_MAX		3
+#endif
+
+/*
+ * Schema fragments sent before waiting for their responses. 1 keeps the
+ * stop-and-wait upload; larger values pipeline the fragments so a thing
+ * with many items pays about one round trip per window instead of one
+ * per item. A lost fragment or ack is sent again after a few measured
+ * response times, from the first fragment not acknowledged.
+ */
+#ifndef KNOT_THING_SCHEMA_WINDOW
+#define KNOT_THING_SCHEMA_WINDOW	1
+#endif
+
+/*
+ * Storage address of the schema cache: one byte plus a 16-bit digest per
+ * item (1 + 2 * KNOT_THING_DATA_MAX bytes). Keep it clear of the area
+ * used by the sketch and of the HAL records at the end of the EEPROM.
+ */
+#ifndef KNOT_THING_SCHEMA_STORAGE_ADDR
+#define KNOT_THING_SCHEMA_STORAGE_ADDR	512
+#endif
+
+/*
+ * Upload only the changed schema fragments. Requires a gateway that
+ * merges fragments by sensor id; otherwise any change resends them all.
+ */
+#ifndef KNOT_THING_SCHEMA_DELTA
+#define KNOT_THING_SCHEMA_DELTA		0
+#endif
+
+/*
+ * Longest wait returned by knot_thing_run_tickless(). Gateway messages
+ * and sensor changes are polled, so this bounds how late they are seen.
+ */
+#ifndef KNOT_THING_POLL_MS
+#define KNOT_THING_POLL_MS		50
+#endif
+
+/*
+ * Shortest time between two reads of the management socket, which only
+ * reports the link going down. It is not read while gateway messages
+ * keep coming, so a link drop may be seen this much later; 0 reads it
+ * in every knot_thing_run() the data socket was idle.
+ */
+#ifndef KNOT_THING_MGMT_POLL_MS
+#define KNOT_THING_MGMT_POLL_MS		10
+#endif
+
+/*
+ * Wait before listening again after an error: a random time between
+ * half and all of KNOT_THING_RETRY_MIN_MS, doubled for every further
+ * error before reaching STATE_RUNNING, up to KNOT_THING_RETRY_MAX_MS.
+ * The sketch keeps running meanwhile.
+ */
+#ifndef KNOT_THING_RETRY_MIN_MS
+#define KNOT_THING_RETRY_MIN_MS		1000
+#endif
+
+#ifndef KNOT_THING_RETRY_MAX_MS
+#define KNOT_THING_RETRY_MAX_MS		60000
+#endif
+
+/*
+ * Random delay of up to this before listening at start and after the
+ * link was lost, so a fleet powered up together or dropped by a gateway
+ * restart does not reconnect at once.
+ */
+#ifndef KNOT_THING_LISTEN_JITTER_MS
+#define KNOT_THING_LISTEN_JITTER_MS	0
+#endif
+
+/*
+ * Keep the uuid and token in RAM once read from storage or received,
+ * so a reconnect does not read them again. Costs 77 bytes of RAM.
+ */
+#ifndef KNOT_THING_CRED_CACHE
+#define KNOT_THING_CRED_CACHE		0
+#endif
+
+/*
+ * A link lost in STATE_RUNNING and back within KNOT_THING_RESUME_MS
+ * goes straight from the authentication to STATE_RUNNING, skipping the
+ * schema check and the push of every item, as long as no message was
+ * left unsent and no item was registered meanwhile. 0 always goes
+ * through STATE_ONLINE.
+ */
+#ifndef KNOT_THING_RESUME_MS
+#define KNOT_THING_RESUME_MS		0
+#endif
+
+/*
+ * Coalesce data messages: when not 0, events found in STATE_RUNNING are
+ * queued back to back, each with its own header, and written together
+ * once KNOT_THING_BATCH_MTU bytes would be exceeded or the oldest one
+ * waited KNOT_THING_BATCH_HOLD_MS, or later if the outbound queue is
+ * full then. Needs a gateway that parses every message in a frame;
+ * costs KNOT_THING_BATCH_MTU bytes of RAM.
+ */
+#ifndef KNOT_THING_BATCH_MTU
+#define KNOT_THING_BATCH_MTU		0
+#endif
+
+#ifndef KNOT_THING_BATCH_HOLD_MS
+#define KNOT_THING_BATCH_HOLD_MS	20
+#endif
+
+/*
+ * 0 checks one item for change and limit events per knot_thing_run().
+ * 1 checks every item in each call and sends all the events found, so
+ * the latency no longer grows with the number of items; a slow read
+ * callback then delays the whole loop. The sweep stops while the
+ * outbound queue is full and goes on from the next item once it has
+ * room, so no event is dropped for it.
+ */
+#ifndef KNOT_THING_FULL_SWEEP
+#define KNOT_THING_FULL_SWEEP		0
+#endif
+
+/*
+ * Per item deadband, limit hysteresis and minimum report interval for
+ * int and float items (knot_thing_filter_data_item()). Costs 15 bytes
+ * of RAM per item slot.
+ */
+#ifndef KNOT_THING_FILTER
+#define KNOT_THING_FILTER		0
+#endif
+
+/*
+ * Raw items changed in place are reported as KNOT_MSG_PUSH_DELTA_REQ
+ * with only the changed byte ranges, and every KNOT_THING_RAW_DELTA-th
+ * report is a full keyframe. Needs a gateway that applies the deltas;
+ * 0 always sends the full value.
+ */
+#ifndef KNOT_THING_RAW_DELTA
+#define KNOT_THING_RAW_DELTA		0
+#endif
+
+/*
+ * Outbound queue of an online thing: data, config and poll replies.
+ * A failed write is retried up to KNOT_THING_TX_RETRIES times, waiting
+ * KNOT_THING_TX_BACKOFF_MS and doubling it each time. Events wait in
+ * their items while the queue is full, but a reply to the gateway
+ * drops the oldest message; KNOT_THING_STATS counts these and messages
+ * out of retries as tx_dropped. Messages are copied in, so each entry
+ * takes 6 bytes plus the largest one: 25 bytes for a 19 byte data push,
+ * 31 with KNOT_THING_OFFLINE_SAMPLES (25 byte aged push), or
+ * 6 + KNOT_THING_BATCH_MTU when that is larger.
+ */
+#ifndef KNOT_THING_TX_QUEUE
+#define KNOT_THING_TX_QUEUE		2
+#endif
+
+#ifndef KNOT_THING_TX_RETRIES
+#define KNOT_THING_TX_RETRIES		4
+#endif
+
+#ifndef KNOT_THING_TX_BACKOFF_MS
+#define KNOT_THING_TX_BACKOFF_MS	10
+#endif
+
+/*
+ * Data pushes tracked until the gateway answers. A failed or timed out
+ * push is sent again as it was (up to KNOT_THING_TX_RETRIES times) and
+ * delivery latency and loss are counted. While every entry is taken
+ * new pushes wait, and so do the events behind them, until responses or
+ * KNOT_THING_PUSH_TIMEOUT_MS free one. Each entry takes 25 bytes;
+ * 0 re-reads the sensor on a failure, as before.
+ */
+#ifndef KNOT_THING_INFLIGHT
+#define KNOT_THING_INFLIGHT		0
+#endif
+
+#ifndef KNOT_THING_PUSH_TIMEOUT_MS
+#define KNOT_THING_PUSH_TIMEOUT_MS	2000
+#endif
+
+/*
+ * Samples kept while the thing is not online: events keep being checked
+ * in every other state and each one is stored with the time it was
+ * taken, oldest dropped first. Back in STATE_RUNNING they are sent as
+ * KNOT_MSG_PUSH_AGED_REQ, up to KNOT_THING_OFFLINE_FLUSH per call, so
+ * the gateway can place them in time. Raw samples are kept in full, as
+ * deltas would not survive the drops. Each sample takes 23 bytes of RAM.
+ */
+#ifndef KNOT_THING_OFFLINE_SAMPLES
+#define KNOT_THING_OFFLINE_SAMPLES	0
+#endif
+
+#ifndef KNOT_THING_OFFLINE_FLUSH
+#define KNOT_THING_OFFLINE_FLUSH	4
+#endif
+
+/*
+ * Samples moved to storage, at KNOT_THING_OFFLINE_STORAGE_ADDR, when the
+ * RAM ring is full (23 bytes each; up to 11 fit below the schema cache,
+ * which the build checks). Every sample spilled is an EEPROM write, so
+ * keep the RAM ring large enough for the usual outages.
+ */
+#ifndef KNOT_THING_OFFLINE_SPILL
+#define KNOT_THING_OFFLINE_SPILL	0
+#endif
+
+#ifndef KNOT_THING_OFFLINE_STORAGE_ADDR
+#define KNOT_THING_OFFLINE_STORAGE_ADDR	256
+#endif
+
+/* Bytes of a stored sample: its time and a knot_msg_data */
+#define KNOT_THING_OFFLINE_SAMPLE_SIZE	23
+
+#if KNOT_THING_OFFLINE_SPILL && KNOT_THING_OFFLINE_STORAGE_ADDR + \
+		KNOT_THING_OFFLINE_SPILL * KNOT_THING_OFFLINE_SAMPLE_SIZE > \
+		KNOT_THING_SCHEMA_STORAGE_ADDR
+#error "KNOT_THING_OFFLINE_SPILL samples overlap the schema cache"
+#endif
+
+/*
+ * Runtime counters read with knot_thing_get_stats(): frames, errors and
+ * retries of the state machine, time spent in each STATE_* and events
+ * sent or suppressed per item. Costs about 105 bytes of RAM plus 4 per
+ * item slot. knot_thing_stats_read() serves a 16-bit snapshot as a raw
+ * item, refreshed at most every KNOT_THING_STATS_PERIOD_MS so the item
+ * isn't reported on each change of the counters.
+ */
+#ifndef KNOT_THING_STATS
+#define KNOT_THING_STATS		0
+#endif
+
+#ifndef KNOT_THING_STATS_PERIOD_MS
+#define KNOT_THING_STATS_PERIOD_MS	60000
+#endif
+
+/*
+ * Time every knot_thing_run() pass and every item read or write
+ * function with hal_time_us(), keeping min, average, max and the calls
+ * over a budget; see knot_thing_get_loop_profile(). Costs 20 bytes of
+ * RAM per item slot plus 20 for the loop, and two clock reads per
+ * timed call.
+ */
+#ifndef KNOT_THING_PROFILE
+#define KNOT_THING_PROFILE		0
+#endif
+
+#ifndef KNOT_THING_LOOP_BUDGET_US
+#define KNOT_THING_LOOP_BUDGET_US	5000
+#endif
+
+#ifndef KNOT_THING_CALLBACK_BUDGET_US
+#define KNOT_THING_CALLBACK_BUDGET_US	1000
+#endif
+
+/*
+ * Read and write functions may return KNOT_THING_PENDING and finish
+ * later with knot_thing_complete_read() or knot_thing_complete_write(),
+ * so a slow peripheral doesn't hold the radio. This many operations may
+ * be pending at once, 25 bytes of RAM each; the ones not completed
+ * within KNOT_THING_ASYNC_TIMEOUT_MS fail. 0 takes KNOT_THING_PENDING
+ * as an error.
+ */
+#ifndef KNOT_THING_ASYNC
+#define KNOT_THING_ASYNC		0
+#endif
+
+#ifndef KNOT_THING_ASYNC_TIMEOUT_MS
+#define KNOT_THING_ASYNC_TIMEOUT_MS	5000
+#endif
+
+/*
+ * Let knot_thing_aggregate_data_item() sample an item as it is swept,
+ * at most once every KNOT_THING_POLL_MS, and send the min, max, mean,
+ * sum or count of each KNOT_EVT_FLAG_TIME window in its one report,
+ * instead of the value read at that moment. Samples are taken while
+ * the minimum interval holds events back too. Costs 25 bytes of RAM
+ * per item slot.
+ */
+#ifndef KNOT_THING_AGGREGATE
+#define KNOT_THING_AGGREGATE		0
+#endif
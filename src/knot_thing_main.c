@@ -21,81 +21,368 @@
 // TODO: normalize all returning error codes
 
 
-const char KNOT_THING_EMPTY_ITEM[] PROGMEM = { "EMPTY ITEM" };
-static uint8_t pos_count, last_item;
+/* Per-loop state flags */
+#define ITEM_FLAG_LOWER		0x01	/* Below lower limit, event sent */
+#define ITEM_FLAG_UPPER		0x02	/* Above upper limit, event sent */
+#define ITEM_FLAG_CTX		0x04	/* Functions are functions.ctx_f */
+#define ITEM_FLAG_PGM		0x08	/* Schema name is in flash */
+
+/* Operations left pending by a read or write function */
+#define ASYNC_READ		0x01	/* Read in progress */
+#define ASYNC_WRITE		0x02	/* Write in progress, echoed when done */
+#define ASYNC_EVENT		0x04	/* Value checked for events */
+#define ASYNC_TIME		0x08	/* Value reported even if unchanged */
+#define ASYNC_POLL		0x10	/* Value sent to the gateway */
+#define ASYNC_DONE		0x80	/* Completed or timed out */
+
+/* Items are packed in registration order: slots 0 to item_count - 1 */
+static uint8_t pos_count, item_count;
+/* Items polled for change or limit events and end of the last sweep */
+static uint8_t watch_count, sweep_idle;
+static uint32_t sweep_time;
+
+#if KNOT_THING_AGGREGATE
+/* Samples of the current report window of an int or float item */
+struct aggregate {
+	uint8_t			mode;		// KNOT_THING_AGG_*
+	uint32_t		count;
+	uint32_t		sample_time;	// hal_time_ms() of the last one
+	knot_value_type		min;
+	knot_value_type		max;
+	union {
+		int64_t		val_i;
+		float		val_f;
+	} sum;
+};
+#endif
+
+#if KNOT_THING_PROFILE
+/*
+ * Durations of one hot path: the average is sum_us / samples, both
+ * halved before sum_us would overflow so it follows recent behavior.
+ */
+struct profile {
+	uint32_t		calls;		// Wrapping
+	uint32_t		sum_us;
+	uint32_t		min_us;
+	uint32_t		max_us;
+	uint16_t		samples;
+	uint16_t		overruns;	// Over the budget, saturating
+};
+
+/* knot_thing_run() and knot_thing_run_tickless() calls */
+static struct profile loop_profile;
+#endif
 
+/*
+ * Per-loop state: everything knot_thing_verify_events() touches for an
+ * item, kept apart from the schema so the event check walks a dense
+ * array and an unused slot costs as little as possible.
+ */
 static struct _data_items {
 	uint8_t			id;		// KNOT_ID
-	// schema values
 	uint8_t			value_type;	// KNOT_VALUE_TYPE_* (int, float, bool, raw)
-	uint8_t			unit;		// KNOT_UNIT_*
-	uint16_t		type_id;	// KNOT_TYPE_ID_*
-	const char		*name;		// App defined data item name
-
-	/* Control the upper lower message flow */
-	uint8_t lower_flag;
-	uint8_t upper_flag;
-
-	// data values
-	knot_value_type		last_data;
-	uint8_t			*last_value_raw;
-	uint8_t			raw_length;
+	uint8_t			flags;		// ITEM_FLAG_*
+	uint8_t			ctx_len;	// Value bytes of ITEM_FLAG_CTX items
+	// data values: raw items compare against the app buffer instead
+	union {
+		knot_value_type	last_data;
+		struct {
+			uint8_t	*buffer;
+			uint8_t	length;
+#if KNOT_THING_RAW_DELTA
+			uint8_t	keyframe_in;	// Deltas left before a full report
+#endif
+		} raw;
+	};
 	// config values
 	knot_config		config;	// Flags indicating when data will be sent
 	// time values
-	uint32_t		last_timeout;	// Stores the last time the data was sent
+	uint32_t		deadline;	// Next KNOT_EVT_FLAG_TIME report
+	uint8_t			timer_pos;	// Position in timer_heap
 	// Data read/write functions
 	knot_data_functions	functions;
+#if KNOT_THING_FILTER
+	knot_thing_filter	filter;		// Change filter of int/float items
+	uint32_t		last_report;	// When the last event was sent
+#endif
+#if KNOT_THING_STATS
+	uint16_t		events_sent;	// Events raised, wrapping
+	uint16_t		events_suppressed;	// Polls of an unsent change
+#endif
+#if KNOT_THING_PROFILE
+	struct profile		profile;	// Read and write callbacks
+#endif
+#if KNOT_THING_AGGREGATE
+	struct aggregate	agg;		// Sent by KNOT_EVT_FLAG_TIME
+#endif
 } data_items[KNOT_THING_DATA_MAX];
 
+/* Schema values: only read while the schema is uploaded */
+static struct _item_schema {
+	uint16_t		type_id;	// KNOT_TYPE_ID_*
+	uint8_t			unit;		// KNOT_UNIT_*
+	const char		*name;		// In flash with ITEM_FLAG_PGM
+	uint8_t			priority;	// Higher is polled first
+} item_schema[KNOT_THING_DATA_MAX];
+
+/* Slots in polling order: by priority, then registration */
+static uint8_t sweep_order[KNOT_THING_DATA_MAX];
+
+/* Slots of the registered items sorted by sensor id */
+static uint8_t id_index[KNOT_THING_DATA_MAX];
+/* Last item found: read, verify and push of a sample hit the same id */
+static struct _data_items *last_found;
+
+/*
+ * Slots of the items reporting on KNOT_EVT_FLAG_TIME, as a min-heap on
+ * their deadline: the next due item is always timer_heap[0].
+ */
+static uint8_t timer_heap[KNOT_THING_DATA_MAX];
+static uint8_t timer_count;
+
+#define TIMER_NONE		0xff
+
+#if KNOT_THING_STATS
+/* Counters served by knot_thing_stats_read() and when they were taken */
+static knot_thing_stats_raw stats_raw;
+static uint32_t stats_raw_time;
+static uint8_t stats_raw_valid;
+#endif
+
+#if KNOT_THING_ASYNC
+/*
+ * Reads and writes completed later by knot_thing_complete_read() and
+ * knot_thing_complete_write(). data holds the message the result goes
+ * out in: the sample read or the echo of the value written.
+ */
+static struct async_op {
+	uint8_t			id;		// 0 if the entry is free
+	uint8_t			flags;		// ASYNC_*
+	uint32_t		start;		// For KNOT_THING_ASYNC_TIMEOUT_MS
+	knot_msg_data		data;
+} async_ops[KNOT_THING_ASYNC];
+#endif
+
+#if KNOT_THING_PROFILE
+static void profile_reset(struct profile *prof)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->min_us = UINT32_MAX;
+}
+
+static void profile_add(struct profile *prof, uint32_t us, uint32_t budget)
+{
+	if (prof->samples == UINT16_MAX || prof->sum_us > UINT32_MAX - us) {
+		prof->samples >>= 1;
+		prof->sum_us >>= 1;
+	}
+
+	prof->calls++;
+	prof->samples++;
+	prof->sum_us += us;
+	if (us < prof->min_us)
+		prof->min_us = us;
+	if (us > prof->max_us)
+		prof->max_us = us;
+	if (us > budget && prof->overruns < UINT16_MAX)
+		prof->overruns++;
+}
+
+static void profile_copy(const struct profile *prof, knot_thing_profile *out)
+{
+	out->calls = prof->calls;
+	out->min_us = prof->calls ? prof->min_us : 0;
+	out->avg_us = prof->samples ? prof->sum_us / prof->samples : 0;
+	out->max_us = prof->max_us;
+	out->overruns = prof->overruns;
+}
+#endif
+
+/* Deadlines wrap with hal_time_ms(): compare by signed distance */
+static inline int8_t deadline_before(uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b) < 0;
+}
+
+static inline uint32_t timer_deadline(uint8_t pos)
+{
+	return data_items[timer_heap[pos]].deadline;
+}
+
+static void timer_place(uint8_t pos, uint8_t slot)
+{
+	timer_heap[pos] = slot;
+	data_items[slot].timer_pos = pos;
+}
+
+static void timer_sift_up(uint8_t pos)
+{
+	uint8_t slot = timer_heap[pos], parent;
+	uint32_t deadline = data_items[slot].deadline;
+
+	while (pos > 0) {
+		parent = (pos - 1) >> 1;
+		if (!deadline_before(deadline, timer_deadline(parent)))
+			break;
+
+		timer_place(pos, timer_heap[parent]);
+		pos = parent;
+	}
+
+	timer_place(pos, slot);
+}
+
+static void timer_sift_down(uint8_t pos)
+{
+	uint8_t slot = timer_heap[pos], child;
+	uint32_t deadline = data_items[slot].deadline;
+
+	while ((child = (pos << 1) + 1) < timer_count) {
+		if (child + 1 < timer_count &&
+			deadline_before(timer_deadline(child + 1),
+						timer_deadline(child)))
+			child++;
+
+		if (!deadline_before(timer_deadline(child), deadline))
+			break;
+
+		timer_place(pos, timer_heap[child]);
+		pos = child;
+	}
+
+	timer_place(pos, slot);
+}
+
+static void timer_remove(uint8_t slot)
+{
+	uint8_t pos = data_items[slot].timer_pos, moved;
+
+	if (pos == TIMER_NONE)
+		return;
+
+	data_items[slot].timer_pos = TIMER_NONE;
+	if (--timer_count == pos)
+		return;
+
+	/* Fill the hole with the last entry and restore the order */
+	moved = timer_heap[timer_count];
+	timer_place(pos, moved);
+	timer_sift_up(pos);
+	timer_sift_down(data_items[moved].timer_pos);
+}
+
+/* (Re)schedules the next time report of the item at slot */
+static void timer_schedule(uint8_t slot, uint32_t now)
+{
+	struct _data_items *item = &data_items[slot];
+
+	if (!(item->config.event_flags & KNOT_EVT_FLAG_TIME)) {
+		timer_remove(slot);
+		return;
+	}
+
+	item->deadline = now + (uint32_t) item->config.time_sec * 1000;
+
+	if (item->timer_pos == TIMER_NONE) {
+		timer_place(timer_count++, slot);
+		timer_sift_up(item->timer_pos);
+		return;
+	}
+
+	timer_sift_up(item->timer_pos);
+	timer_sift_down(item->timer_pos);
+}
+
+/* Items whose value must be polled to detect change or limit events */
+static inline uint8_t item_is_watched(const struct _data_items *item)
+{
+#if KNOT_THING_AGGREGATE
+	/* Aggregated items are sampled on every sweep */
+	if (item->agg.mode)
+		return 1;
+#endif
+	return item->value_type == KNOT_VALUE_TYPE_RAW ||
+		(item->config.event_flags & (KNOT_EVT_FLAG_CHANGE |
+					KNOT_EVT_FLAG_LOWER_THRESHOLD |
+					KNOT_EVT_FLAG_UPPER_THRESHOLD));
+}
+
 static struct _data_items *find_item(uint8_t id)
 {
-	uint8_t index;
+	struct _data_items *item;
+	uint8_t low = 0, high = item_count, mid;
+
 	/* Sensor ID value 0 can't be used */
 	if (id == 0)
 		return NULL;
 
-	for (index = 0; index < KNOT_THING_DATA_MAX; index++) {
-		if (data_items[index].id == id)
-			return &data_items[index];
+	if (last_found && last_found->id == id)
+		return last_found;
+
+	while (low < high) {
+		mid = (low + high) >> 1;
+		item = &data_items[id_index[mid]];
+		if (item->id == id) {
+			last_found = item;
+			return item;
+		}
+
+		if (item->id < id)
+			low = mid + 1;
+		else
+			high = mid;
 	}
 
 	return NULL;
 }
 
-static void reset_data_items(void)
+/* Adds the slot at item_count to the sorted index */
+static void index_insert(void)
 {
-	struct _data_items *item = data_items;
-	int8_t count;
+	uint8_t pos = item_count;
+	uint8_t id = data_items[item_count].id;
 
-	pos_count = 0;
-	last_item = 0;
-
-	for (count = 0; count < KNOT_THING_DATA_MAX; ++count, ++item) {
-		item->id					= 0;
-		item->name					= (const char *)pgm_read_word(KNOT_THING_EMPTY_ITEM);
-		item->type_id					= KNOT_TYPE_ID_INVALID;
-		item->unit					= KNOT_UNIT_NOT_APPLICABLE;
-		item->value_type				= KNOT_VALUE_TYPE_INVALID;
-		item->config.event_flags			= KNOT_EVT_FLAG_UNREGISTERED;
-		/* As "last_data" is a union, we need just to set the "biggest" member*/
-		item->last_data.val_i				= 0;
-		/* As "lower_limit" is a union, we need just to set the "biggest" member */
-		item->config.lower_limit.val_i		= 0;
-		/* As "upper_limit" is a union, we need just to set the "biggest" member */
-		item->config.upper_limit.val_i		= 0;
-		item->last_value_raw				= NULL;
-		item->raw_length				= 0;
-		/* As "functions" is a union, we need just to set only one of its members */
-		item->functions.int_f.read			= NULL;
-		item->functions.int_f.write			= NULL;
-
-		item->lower_flag = 0;
-		item->upper_flag = 0;
-		/* Last timeout reset */
-		item->last_timeout = 0;
-		/* TODO:last_value_raw needs to be cleared/reset? */
+	while (pos > 0 && data_items[id_index[pos - 1]].id > id) {
+		id_index[pos] = id_index[pos - 1];
+		pos--;
+	}
+
+	id_index[pos] = item_count;
+}
+
+/* Places the slot in sweep_order, behind the items of equal priority */
+static void sweep_insert(uint8_t slot, uint8_t count)
+{
+	uint8_t pos = count;
+	uint8_t priority = item_schema[slot].priority;
+
+	while (pos > 0 && item_schema[sweep_order[pos - 1]].priority < priority) {
+		sweep_order[pos] = sweep_order[pos - 1];
+		pos--;
 	}
+
+	sweep_order[pos] = slot;
+}
+
+static void reset_data_items(void)
+{
+	/* Slots past item_count are never read: no need to clear them */
+	pos_count = 0;
+	item_count = 0;
+	timer_count = 0;
+	watch_count = 0;
+	sweep_idle = 0;
+	last_found = NULL;
+#if KNOT_THING_STATS
+	stats_raw_valid = 0;
+#endif
+#if KNOT_THING_PROFILE
+	profile_reset(&loop_profile);
+#endif
+#if KNOT_THING_ASYNC
+	memset(async_ops, 0, sizeof(async_ops));
+#endif
 }
 
 static int data_function_is_valid(knot_data_functions *func)
@@ -129,8 +416,88 @@ int8_t knot_thing_register_raw_data_item(uint8_t id, const char *name,
 		return -1;
 
 	/* TODO: Find an alternative way to assign raw buffer */
-	data_items[last_item].last_value_raw = raw_buffer;
-	data_items[last_item].raw_length = raw_buffer_len;
+	data_items[item_count - 1].raw.buffer = raw_buffer;
+	data_items[item_count - 1].raw.length = raw_buffer_len;
+
+	return 0;
+}
+
+int8_t knot_thing_register_item_table(const knot_thing_item_def *table,
+							uint8_t count)
+{
+	knot_thing_item_def def;
+	uint8_t i;
+
+	for (i = 0; i < count; i++) {
+		memcpy_P(&def, &table[i], sizeof(def));
+
+		if (def.value_type == KNOT_VALUE_TYPE_RAW)
+			return -1;
+
+		/* The name is left in flash, read again for the schema */
+		if (knot_thing_register_data_item(def.id, table[i].name,
+				def.type_id, def.value_type, def.unit,
+				&def.functions) != 0)
+			return -1;
+
+		data_items[item_count - 1].flags |= ITEM_FLAG_PGM;
+
+		if (def.config.event_flags &&
+			knot_thing_config_data_item(def.id,
+					def.config.event_flags,
+					def.config.time_sec,
+					&def.config.lower_limit,
+					&def.config.upper_limit) != 0)
+			return -1;
+
+		if (def.priority)
+			knot_thing_set_item_priority(def.id, def.priority);
+	}
+
+	return 0;
+}
+
+/* Bytes of the value of an item, as sent in knot_msg_data */
+static uint8_t value_len(const struct _data_items *item)
+{
+	switch (item->value_type) {
+	case KNOT_VALUE_TYPE_RAW:
+		return item->raw.length;
+	case KNOT_VALUE_TYPE_BOOL:
+		return sizeof(knot_value_type_bool);
+	case KNOT_VALUE_TYPE_INT:
+		return sizeof(knot_value_type_int);
+	case KNOT_VALUE_TYPE_FLOAT:
+		return sizeof(knot_value_type_float);
+	default:
+		return 0;
+	}
+}
+
+int8_t knot_thing_register_ctx_data_item(uint8_t id, const char *name,
+	uint16_t type_id, uint8_t value_type, uint8_t unit,
+	const knot_ctx_ops *ops, void *ctx)
+{
+	struct _data_items *item;
+	knot_data_functions func;
+
+	/* Raw items compare against a buffer the functions can't size */
+	if (ops == NULL || value_type == KNOT_VALUE_TYPE_RAW)
+		return -1;
+
+	if (ops->read == NULL && ops->write == NULL)
+		return -1;
+
+	func.ctx_f.ops = ops;
+	func.ctx_f.ctx = ctx;
+
+	if (knot_thing_register_data_item(id, name, type_id, value_type,
+							unit, &func) != 0)
+		return -1;
+
+	item = &data_items[item_count - 1];
+	item->flags |= ITEM_FLAG_CTX;
+	item->ctx_len = value_len(item);
 
 	return 0;
 }
@@ -144,25 +511,28 @@ int8_t knot_thing_register_data_item(uint8_t id, const char *name,
 				uint8_t unit, knot_data_functions *func)
 {
 	struct _data_items *item;
-	uint8_t index;
-
-	for (index = 0, item = NULL; index < KNOT_THING_DATA_MAX; index++) {
-		if (data_items[index].id == 0) {
-			item = &data_items[index];
-			last_item  = index;
-			break;
-		}
-	}
+	struct _item_schema *schema;
 
-	if ((!item) || (knot_schema_is_valid(type_id, value_type, unit) != 0) ||
+	if (item_count == KNOT_THING_DATA_MAX ||
+		(knot_schema_is_valid(type_id, value_type, unit) != 0) ||
 		name == NULL || (data_function_is_valid(func) != 0))
 		return -1;
 
+	/* Sensor id must be unique and 0 can't be used */
+	if (id == 0 || find_item(id))
+		return -1;
+
+	item = &data_items[item_count];
+	schema = &item_schema[item_count];
+
+	schema->name					= name;
+	schema->type_id					= type_id;
+	schema->unit					= unit;
+	schema->priority				= 0;
+
 	item->id					= id;
-	item->name					= name;
-	item->type_id					= type_id;
-	item->unit					= unit;
 	item->value_type				= value_type;
+	item->flags					= 0;
 
 	/* Set default config */
 	item->config.event_flags			= KNOT_EVT_FLAG_TIME;
@@ -173,12 +543,37 @@ int8_t knot_thing_register_data_item(uint8_t id, const char *name,
 	item->config.lower_limit.val_i		= 0;
 	/* As "upper_limit" is a union, we need just to set the "biggest" member */
 	item->config.upper_limit.val_i		= 0;
-	item->last_value_raw				= NULL;
-	/* As "functions" is a union, we need just to set only one of its members */
-	item->functions.int_f.read			= func->int_f.read;
-	item->functions.int_f.write			= func->int_f.write;
-	/* Starting last_timeout with the current time */
-	item->last_timeout 				= hal_time_ms();
+	if (value_type == KNOT_VALUE_TYPE_RAW) {
+		item->raw.buffer			= NULL;
+		item->raw.length			= 0;
+#if KNOT_THING_RAW_DELTA
+		item->raw.keyframe_in			= 0;
+#endif
+	}
+	/* As "functions" is a union, copy it whole: members differ in type */
+	memcpy(&item->functions, func, sizeof(item->functions));
+	/* First time report one period from now */
+	item->timer_pos					= TIMER_NONE;
+	timer_schedule(item_count, hal_time_ms());
+#if KNOT_THING_FILTER
+	memset(&item->filter, 0, sizeof(item->filter));
+#endif
+#if KNOT_THING_STATS
+	item->events_sent				= 0;
+	item->events_suppressed				= 0;
+#endif
+#if KNOT_THING_PROFILE
+	profile_reset(&item->profile);
+#endif
+#if KNOT_THING_AGGREGATE
+	memset(&item->agg, 0, sizeof(item->agg));
+#endif
+
+	watch_count += item_is_watched(item);
+	index_insert();
+	sweep_insert(item_count, item_count);
+	item_count++;
+
 	return 0;
 }
 
@@ -188,16 +583,18 @@ int knot_thing_config_data_item(uint8_t id, uint8_t evflags, uint16_t time_sec,
 {
 	struct _data_items *item = find_item(id);
 
+	if (!item)
+		return -1;
+
 	/*Check if config is valid*/
 	if (knot_config_is_valid(evflags, item->value_type,
 				 time_sec, lower, upper) != 0)
 		return -1;
 
-	if (!item)
-		return -1;
-
+	watch_count -= item_is_watched(item);
 	item->config.event_flags = evflags;
 	item->config.time_sec = time_sec;
+	watch_count += item_is_watched(item);
 
 	/*
 	 * "lower/upper limit" is a union, we need
@@ -210,47 +607,204 @@ int knot_thing_config_data_item(uint8_t id, uint8_t evflags, uint16_t time_sec,
 	if (upper)
 		memcpy(&(item->config.upper_limit), upper, sizeof(*upper));
 
+	/* A new period counts from now */
+	timer_schedule(item - data_items, hal_time_ms());
+
+	return 0;
+}
+
+int knot_thing_filter_data_item(uint8_t id, const knot_thing_filter *filter)
+{
+#if KNOT_THING_FILTER
+	struct _data_items *item = find_item(id);
+
+	if (!item || !filter)
+		return -1;
+
+	if (item->value_type != KNOT_VALUE_TYPE_INT &&
+			item->value_type != KNOT_VALUE_TYPE_FLOAT)
+		return -1;
+
+	memcpy(&item->filter, filter, sizeof(*filter));
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int knot_thing_aggregate_data_item(uint8_t id, uint8_t mode)
+{
+#if KNOT_THING_AGGREGATE
+	struct _data_items *item = find_item(id);
+
+	if (!item || mode > KNOT_THING_AGG_COUNT)
+		return -1;
+
+	if (mode != KNOT_THING_AGG_NONE &&
+			item->value_type != KNOT_VALUE_TYPE_INT &&
+			item->value_type != KNOT_VALUE_TYPE_FLOAT)
+		return -1;
+
+	watch_count -= item_is_watched(item);
+	memset(&item->agg, 0, sizeof(item->agg));
+	item->agg.mode = mode;
+	watch_count += item_is_watched(item);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int knot_thing_set_item_priority(uint8_t id, uint8_t priority)
+{
+	struct _data_items *item = find_item(id);
+	uint8_t slot, pos;
+
+	if (!item)
+		return -1;
+
+	slot = item - data_items;
+	item_schema[slot].priority = priority;
+
+	/* Take the slot out of the order and put it back in its place */
+	for (pos = 0; sweep_order[pos] != slot; pos++)
+		;
+	for (; pos + 1 < item_count; pos++)
+		sweep_order[pos] = sweep_order[pos + 1];
+
+	sweep_insert(slot, item_count - 1);
+
+	/* Restart the sweep so no item is skipped or seen twice */
+	pos_count = 0;
+
 	return 0;
 }
 
 int knot_thing_create_schema(uint8_t index, knot_msg_schema *msg)
 {
 	struct _data_items *item;
+	struct _item_schema *schema;
 
-	if (index > last_item)
+	if (index >= item_count)
 		return KNOT_ERR_INVALID;
 
 	item = data_items + index;
-	if (item->id == 0)
-		return KNOT_ERR_INVALID;
+	schema = item_schema + index;
 
 	msg->hdr.type = KNOT_MSG_SCHM_FRAG_REQ;
 
 	msg->sensor_id = item->id;
 	msg->values.value_type = item->value_type;
-	msg->values.unit = item->unit;
-	msg->values.type_id = item->type_id;
-	strncpy(msg->values.name, item->name, sizeof(msg->values.name));
+	msg->values.unit = schema->unit;
+	msg->values.type_id = schema->type_id;
+	if (item->flags & ITEM_FLAG_PGM)
+		strncpy_P(msg->values.name, schema->name,
+						sizeof(msg->values.name));
+	else
+		strncpy(msg->values.name, schema->name,
+						sizeof(msg->values.name));
 
 	msg->hdr.payload_len = sizeof(msg->values) + sizeof(msg->sensor_id);
 
 	/* Send 'end' for the last item (sensor or actuator). */
-	if (index == last_item)
+	if (index == item_count - 1)
 		msg->hdr.type = KNOT_MSG_SCHM_END_REQ;
 
 	return 0;
 }
 
-int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
+#if KNOT_THING_ASYNC
+static struct async_op *async_find(uint8_t id, uint8_t kind)
 {
-	struct _data_items *item;
-	int len;
+	uint8_t i;
 
-	item = find_item(id);
-	if (!item)
-		return -2;
+	for (i = 0; i < KNOT_THING_ASYNC; i++)
+		if (async_ops[i].id == id && (async_ops[i].flags & kind))
+			return &async_ops[i];
+
+	return NULL;
+}
+
+/* Takes a free entry; NULL if as many operations are already pending */
+static struct async_op *async_start(uint8_t id, uint8_t flags,
+						const knot_msg_data *data)
+{
+	struct async_op *op = NULL;
+	uint8_t i;
+
+	for (i = 0; i < KNOT_THING_ASYNC && !op; i++)
+		if (async_ops[i].id == 0)
+			op = &async_ops[i];
+
+	if (!op)
+		return NULL;
+
+	op->id = id;
+	op->flags = flags;
+	op->start = hal_time_ms();
+	memcpy(&op->data, data, sizeof(*data));
+
+	return op;
+}
+
+/* Frees a read once nothing waits for its value */
+static void async_release(struct async_op *op)
+{
+	if (!(op->flags & (ASYNC_EVENT | ASYNC_POLL | ASYNC_WRITE)))
+		op->id = 0;
+}
+
+/* Completes with an error: the gateway gets it instead of the value */
+static void async_fail(struct async_op *op)
+{
+	op->data.hdr.type = op->flags & ASYNC_WRITE ? KNOT_ERR_INVALID :
+								KNOT_ERR_PERM;
+	op->data.hdr.payload_len = sizeof(op->data.sensor_id);
+	/* A poll started from a message that held another item */
+	op->data.sensor_id = op->id;
+	op->flags |= ASYNC_DONE;
+}
+
+static void async_expire(void)
+{
+	uint32_t now = hal_time_ms();
+	uint8_t i;
+
+	for (i = 0; i < KNOT_THING_ASYNC; i++)
+		if (async_ops[i].id && !(async_ops[i].flags & ASYNC_DONE) &&
+			now - async_ops[i].start >= KNOT_THING_ASYNC_TIMEOUT_MS)
+			async_fail(&async_ops[i]);
+}
+#endif
+
+/* A failed read is -1, a read still in progress KNOT_THING_PENDING */
+static inline int read_error(int ret)
+{
+	return ret == KNOT_THING_PENDING ? ret : -1;
+}
+
+static int item_read_value(struct _data_items *item, knot_msg_data *data)
+{
+	const knot_ctx_functions *ctx_f = &item->functions.ctx_f;
+	int len;
 
 	data->hdr.payload_len = sizeof(data->sensor_id);
+
+	/* The registration fixed the type and length: no switch on them */
+	if (item->flags & ITEM_FLAG_CTX) {
+		if (ctx_f->ops->read == NULL)
+			return -1;
+
+		len = ctx_f->ops->read(ctx_f->ctx, &data->payload);
+		if (len < 0)
+			return read_error(len);
+
+		data->hdr.payload_len += item->ctx_len;
+		return 0;
+	}
+
 	switch (item->value_type) {
 	case KNOT_VALUE_TYPE_RAW:
 		if (item->functions.raw_f.read == NULL)
@@ -259,9 +813,9 @@ int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 		len = item->functions.raw_f.read(data->payload.raw,
 						 sizeof(data->payload.raw));
 		if (len < 0)
-			return -1;
+			return read_error(len);
 
-		if (len > item->raw_length)
+		if (len > item->raw.length)
 			return -1;
 
 		data->hdr.payload_len += len;
@@ -270,8 +824,9 @@ int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 		if (item->functions.bool_f.read == NULL)
 			return -1;
 
-		if (item->functions.bool_f.read(&(data->payload.val_b)) < 0)
-			return -1;
+		len = item->functions.bool_f.read(&(data->payload.val_b));
+		if (len < 0)
+			return read_error(len);
 
 		data->hdr.payload_len += sizeof(knot_value_type_bool);
 		break;
@@ -279,9 +834,9 @@ int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 		if (item->functions.int_f.read == NULL)
 			return -1;
 
-		if (item->functions.int_f.read(
-			&data->payload.val_i) < 0)
-			return -1;
+		len = item->functions.int_f.read(&data->payload.val_i);
+		if (len < 0)
+			return read_error(len);
 
 		data->hdr.payload_len += sizeof(knot_value_type_int);
 		break;
@@ -289,9 +844,9 @@ int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 		if (item->functions.float_f.read == NULL)
 			return -1;
 
-		if (item->functions.float_f.read(
-			&data->payload.val_f) < 0)
-			return -1;
+		len = item->functions.float_f.read(&data->payload.val_f);
+		if (len < 0)
+			return read_error(len);
 
 		data->hdr.payload_len += sizeof(knot_value_type_float);
 		break;
@@ -302,27 +857,107 @@ int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 	return 0;
 }
 
-int knot_thing_data_item_write(uint8_t id, knot_msg_data *data)
+/*
+ * Calls the read function of the item, timing it with KNOT_THING_PROFILE.
+ * With KNOT_THING_ASYNC a read in progress or not yet handled is not
+ * started again: reason (ASYNC_*) is added to what its value is for.
+ */
+static int item_read(struct _data_items *item, knot_msg_data *data,
+							uint8_t reason)
+{
+	int ret;
+#if KNOT_THING_PROFILE
+	uint32_t start;
+#endif
+#if KNOT_THING_ASYNC
+	struct async_op *op = async_find(item->id, ASYNC_READ);
+
+	if (op) {
+		op->flags |= reason;
+		return KNOT_THING_PENDING;
+	}
+#endif
+
+#if KNOT_THING_PROFILE
+	start = hal_time_us();
+	ret = item_read_value(item, data);
+	profile_add(&item->profile, hal_time_us() - start,
+					KNOT_THING_CALLBACK_BUDGET_US);
+#else
+	ret = item_read_value(item, data);
+#endif
+
+#if KNOT_THING_ASYNC
+	if (ret == KNOT_THING_PENDING &&
+			!async_start(item->id, ASYNC_READ | reason, data))
+		ret = -1;
+#else
+	if (ret == KNOT_THING_PENDING)
+		ret = -1;
+#endif
+
+	return ret;
+}
+
+int knot_thing_data_item_read(uint8_t id, knot_msg_data *data)
 {
-	int8_t ret_val = -1;
-	int8_t ilen;
 	struct _data_items *item;
 
 	item = find_item(id);
 	if (!item)
-		return -1;
+		return -2;
 
-	/* Received data length */
-	ilen = data->hdr.payload_len - sizeof(data->sensor_id);
-	/* Setting length to send */
-	data->hdr.payload_len = sizeof(data->sensor_id);
+#if KNOT_THING_RAW_DELTA
+	/* Sent in full outside of the events: deltas need a new base */
+	if (item->value_type == KNOT_VALUE_TYPE_RAW)
+		item->raw.keyframe_in = 0;
+#endif
 
-	switch (item->value_type) {
-	case KNOT_VALUE_TYPE_RAW:
-		if (item->functions.raw_f.write == NULL)
+	return item_read(item, data, ASYNC_POLL);
+}
+
+void knot_thing_raw_keyframe(void)
+{
+#if KNOT_THING_RAW_DELTA
+	uint8_t i;
+
+	for (i = 0; i < item_count; i++)
+		if (data_items[i].value_type == KNOT_VALUE_TYPE_RAW)
+			data_items[i].raw.keyframe_in = 0;
+#endif
+}
+
+static int item_write_value(struct _data_items *item, knot_msg_data *data)
+{
+	const knot_ctx_functions *ctx_f = &item->functions.ctx_f;
+	int8_t ret_val = -1;
+	int8_t ilen;
+
+	/* Received data length */
+	ilen = data->hdr.payload_len - sizeof(data->sensor_id);
+	/* Setting length to send */
+	data->hdr.payload_len = sizeof(data->sensor_id);
+
+	if (item->flags & ITEM_FLAG_CTX) {
+		if (ctx_f->ops->write == NULL)
+			return -1;
+
+		ret_val = ctx_f->ops->write(ctx_f->ctx, &data->payload);
+		if (ret_val < 0)
+			return ret_val;
+
+		data->hdr.payload_len += item->ctx_len;
+		return ret_val;
+	}
+
+	switch (item->value_type) {
+	case KNOT_VALUE_TYPE_RAW:
+		if (item->functions.raw_f.write == NULL)
 			goto done;
 
 		ret_val = item->functions.raw_f.write(data->payload.raw, ilen);
+		if (ret_val == KNOT_THING_PENDING)
+			break;
 		if (ret_val < 0 || ret_val > KNOT_DATA_RAW_SIZE)
 			return -1;
 
@@ -369,124 +1004,541 @@ done:
 	return ret_val;
 }
 
-int8_t knot_thing_run(void)
+int knot_thing_data_item_write(uint8_t id, knot_msg_data *data)
+{
+	struct _data_items *item;
+	int ret;
+#if KNOT_THING_PROFILE
+	uint32_t start;
+#endif
+
+	item = find_item(id);
+	if (!item)
+		return -1;
+
+#if KNOT_THING_ASYNC
+	/* One write at a time: the gateway gets an error for the next */
+	if (async_find(id, ASYNC_WRITE))
+		return -1;
+#endif
+
+#if KNOT_THING_PROFILE
+	start = hal_time_us();
+	ret = item_write_value(item, data);
+	profile_add(&item->profile, hal_time_us() - start,
+					KNOT_THING_CALLBACK_BUDGET_US);
+#else
+	ret = item_write_value(item, data);
+#endif
+
+#if KNOT_THING_ASYNC
+	/* The echo waits for knot_thing_complete_write() */
+	if (ret == KNOT_THING_PENDING &&
+			!async_start(id, ASYNC_WRITE, data))
+		ret = -1;
+#endif
+
+	return ret;
+}
+
+/* One pass of the state machine, timed with KNOT_THING_PROFILE */
+static int8_t loop_run(void)
 {
+#if KNOT_THING_PROFILE
+	uint32_t start = hal_time_us();
+	int8_t ret = knot_thing_protocol_run();
+
+	profile_add(&loop_profile, hal_time_us() - start,
+					KNOT_THING_LOOP_BUDGET_US);
+
+	return ret;
+#else
 	return knot_thing_protocol_run();
+#endif
 }
 
-int knot_thing_verify_events(knot_msg_data *data)
+int8_t knot_thing_run(void)
+{
+	return loop_run();
+}
+
+/* Next watched item of the sweep, or NULL when the sweep is over */
+static struct _data_items *sweep_next(uint32_t now)
 {
 	struct _data_items *item;
-	knot_value_type *last;
-	uint8_t comparison = 0;
-	/* Current time in miliseconds to verify sensor timeout */
-	uint32_t current_time;
 
-	/*
-	 * To avoid an extensive loop we keep an variable to iterate over all
-	 * sensors/actuators once at each loop. When the last sensor was verified
-	 * we reinitialize the counter, otherwise we just increment it.
-	 */
+	while (pos_count < item_count) {
+		item = &data_items[sweep_order[pos_count++]];
+		if (item_is_watched(item)) {
+			sweep_idle = 0;
+			return item;
+		}
+	}
 
-	item = &data_items[pos_count];
-	if (item->id == 0)
-		goto none;
+	pos_count = 0;
+	sweep_idle = 1;
+	sweep_time = now;
 
-	data->hdr.type = KNOT_MSG_PUSH_DATA_REQ;
-	data->sensor_id = item->id;
+	return NULL;
+}
+
+/* Margin a value must move back past a limit to re-arm its event */
+static inline knot_value_type item_hysteresis(const struct _data_items *item)
+{
+#if KNOT_THING_FILTER
+	return item->filter.hysteresis;
+#else
+	knot_value_type none;
+
+	none.val_i = 0;
+
+	return none;
+#endif
+}
+
+/* Whether value moved away from the last reported one by the deadband */
+static uint8_t int_changed(const struct _data_items *item, int32_t value)
+{
+	int32_t last = item->last_data.val_i;
+	uint32_t delta, band = 0;
+
+	delta = value > last ? (uint32_t) value - (uint32_t) last :
+					(uint32_t) last - (uint32_t) value;
+#if KNOT_THING_FILTER
+	band = item->filter.deadband.val_i;
+	if (item->filter.flags & KNOT_THING_FILTER_PERCENT) {
+		/* band% of |last|, split to stay clear of overflow */
+		last = last < 0 ? -last : last;
+		band = (uint32_t) last / 100 * band +
+					(uint32_t) last % 100 * band / 100;
+	}
+#endif
+	return delta > band;
+}
+
+static uint8_t float_changed(const struct _data_items *item, float value)
+{
+	float last = item->last_data.val_f;
+	float delta = value - last, band = 0;
+
+	if (delta < 0)
+		delta = -delta;
+#if KNOT_THING_FILTER
+	band = item->filter.deadband.val_f;
+	if (item->filter.flags & KNOT_THING_FILTER_PERCENT)
+		band *= (last < 0 ? -last : last) / 100;
+#endif
+	return delta > band;
+}
+
+#if KNOT_THING_RAW_DELTA
+/*
+ * Keeps the new raw sample as the last value and, unless a keyframe is
+ * due, rewrites the message as the byte ranges that changed: offset,
+ * length and bytes, back to back. Ranges closer than a range header are
+ * merged, and if the ranges aren't smaller the full sample goes.
+ */
+static void raw_delta_encode(struct _data_items *item, knot_msg_data *data)
+{
+	uint8_t delta[KNOT_DATA_RAW_SIZE];
+	uint8_t *last = item->raw.buffer, *raw = data->payload.raw;
+	uint8_t len = data->hdr.payload_len - sizeof(data->sensor_id);
+	uint8_t pos = 0, start, end, out = 0;
+
+	if (item->raw.keyframe_in == 0 || len != item->raw.length)
+		goto keyframe;
+
+	while (pos < len) {
+		if (raw[pos] == last[pos]) {
+			pos++;
+			continue;
+		}
+
+		start = end = pos;
+		for (pos++; pos < len && pos - end <= 3; pos++)
+			if (raw[pos] != last[pos])
+				end = pos;
+
+		if (out + 2 + (end - start + 1) >= len)
+			goto keyframe;
+
+		delta[out++] = start;
+		delta[out++] = end - start + 1;
+		memcpy(&delta[out], &raw[start], end - start + 1);
+		out += end - start + 1;
+		pos = end + 1;
+	}
+
+	memcpy(last, raw, item->raw.length);
+	memcpy(raw, delta, out);
+	data->hdr.type = KNOT_MSG_PUSH_DELTA_REQ;
+	data->hdr.payload_len = sizeof(data->sensor_id) + out;
+	item->raw.keyframe_in--;
+
+	return;
 
-	if (knot_thing_data_item_read(item->id, data) < 0)
-		goto none;
+keyframe:
+	memcpy(last, raw, item->raw.length);
+	item->raw.keyframe_in = KNOT_THING_RAW_DELTA - 1;
+}
+#endif
+
+#if KNOT_THING_STATS
+/* A value read differs from the one last reported; raw items always raise */
+static uint8_t value_changed(const struct _data_items *item,
+						const knot_msg_data *data)
+{
+	switch (item->value_type) {
+	case KNOT_VALUE_TYPE_BOOL:
+		return data->payload.val_b != item->last_data.val_b;
+	case KNOT_VALUE_TYPE_INT:
+		return data->payload.val_i != item->last_data.val_i;
+	case KNOT_VALUE_TYPE_FLOAT:
+		return data->payload.val_f != item->last_data.val_f;
+	default:
+		return 0;
+	}
+}
+#endif
+
+/*
+ * Compares the value read in data with the item state and returns the
+ * events it raised, starting from the ones in comparison.
+ */
+static uint8_t item_compare(struct _data_items *item, knot_msg_data *data,
+							uint8_t comparison)
+{
+	knot_value_type *last;
+	knot_value_type hyst;
 
 	last = &(item->last_data);
 
-	/* Value did not change or error: return -1, 0 means send data */
+	/* Value did not change or error: no event */
 	switch (item->value_type) {
 	case KNOT_VALUE_TYPE_RAW:
 
-		if (item->last_value_raw == NULL)
-			goto none;
+		if (item->raw.buffer == NULL)
+			break;
 
-		if (memcmp(item->last_value_raw, data->payload.raw,
-			   item->raw_length) == 0)
-			goto none;
+		if (memcmp(item->raw.buffer, data->payload.raw,
+			   item->raw.length) == 0)
+			break;
 
-		memcpy(item->last_value_raw, data->payload.raw,
-		       item->raw_length);
+#if KNOT_THING_RAW_DELTA
+		raw_delta_encode(item, data);
+#else
+		memcpy(item->raw.buffer, data->payload.raw,
+		       item->raw.length);
+#endif
 		comparison = 1;
 		break;
 	case KNOT_VALUE_TYPE_BOOL:
-		if (data->payload.val_b != last->val_b) {
+		if (data->payload.val_b != last->val_b)
 			comparison |= (KNOT_EVT_FLAG_CHANGE & item->config.event_flags);
-			last->val_b = data->payload.val_b;
-		}
 		break;
 	case KNOT_VALUE_TYPE_INT:
 		// TODO: add multiplier to comparison
+		hyst = item_hysteresis(item);
 		if (data->payload.val_i < item->config.lower_limit.val_i &&
-						item->lower_flag == 0) {
+						!(item->flags & ITEM_FLAG_LOWER)) {
 			comparison |= (KNOT_EVT_FLAG_LOWER_THRESHOLD & item->config.event_flags);
-			item->upper_flag = 0;
-			item->lower_flag = 1;
+			item->flags &= ~ITEM_FLAG_UPPER;
+			item->flags |= ITEM_FLAG_LOWER;
 		} else if (data->payload.val_i > item->config.upper_limit.val_i &&
-			   item->upper_flag == 0) {
+			   !(item->flags & ITEM_FLAG_UPPER)) {
 			comparison |= (KNOT_EVT_FLAG_UPPER_THRESHOLD & item->config.event_flags);
-			item->upper_flag = 1;
-			item->lower_flag = 0;
+			item->flags &= ~ITEM_FLAG_LOWER;
+			item->flags |= ITEM_FLAG_UPPER;
 		} else {
-			if (data->payload.val_i < item->config.upper_limit.val_i)
-				item->upper_flag = 0;
-			if (data->payload.val_i > item->config.lower_limit.val_i)
-				item->lower_flag = 0;
+			if (data->payload.val_i < item->config.upper_limit.val_i -
+								hyst.val_i)
+				item->flags &= ~ITEM_FLAG_UPPER;
+			if (data->payload.val_i > item->config.lower_limit.val_i +
+								hyst.val_i)
+				item->flags &= ~ITEM_FLAG_LOWER;
 		}
 
-		if (data->payload.val_i != last->val_i)
+		if (int_changed(item, data->payload.val_i))
 			comparison |= (KNOT_EVT_FLAG_CHANGE & item->config.event_flags);
-
-		last->val_i = data->payload.val_i;
 		break;
 	case KNOT_VALUE_TYPE_FLOAT:
 		// TODO: add multiplier and decimal part to comparison
+		hyst = item_hysteresis(item);
 		if (data->payload.val_f < item->config.lower_limit.val_f &&
-				item->lower_flag == 0) {
+				!(item->flags & ITEM_FLAG_LOWER)) {
 			comparison |= (KNOT_EVT_FLAG_LOWER_THRESHOLD & item->config.event_flags);
-			item->upper_flag = 0;
-			item->lower_flag = 1;
+			item->flags &= ~ITEM_FLAG_UPPER;
+			item->flags |= ITEM_FLAG_LOWER;
 		} else if (data->payload.val_f > item->config.upper_limit.val_f &&
-			   item->upper_flag == 0) {
+			   !(item->flags & ITEM_FLAG_UPPER)) {
 			comparison |= (KNOT_EVT_FLAG_UPPER_THRESHOLD & item->config.event_flags);
-			item->upper_flag = 1;
-			item->lower_flag = 0;
+			item->flags &= ~ITEM_FLAG_LOWER;
+			item->flags |= ITEM_FLAG_UPPER;
 		} else {
-			if (data->payload.val_f < item->config.upper_limit.val_f)
-				item->upper_flag = 0;
-			if (data->payload.val_f > item->config.lower_limit.val_f)
-				item->lower_flag = 0;
+			if (data->payload.val_f < item->config.upper_limit.val_f -
+								hyst.val_f)
+				item->flags &= ~ITEM_FLAG_UPPER;
+			if (data->payload.val_f > item->config.lower_limit.val_f +
+								hyst.val_f)
+				item->flags &= ~ITEM_FLAG_LOWER;
 		}
-		if (data->payload.val_f != last->val_f)
+		if (float_changed(item, data->payload.val_f))
 			comparison |= (KNOT_EVT_FLAG_CHANGE & item->config.event_flags);
-
-		last->val_f = data->payload.val_f;
 		break;
 	default:
 		// This data item is not registered with a valid value type
-		goto none;
+		return 0;
+	}
+
+	if (comparison == 0) {
+#if KNOT_THING_STATS
+		if (value_changed(item, data))
+			item->events_suppressed++;
+#endif
+		return 0;
+	}
+
+#if KNOT_THING_STATS
+	item->events_sent++;
+#endif
+
+	/* Changes are measured from the value last reported */
+	if (item->value_type != KNOT_VALUE_TYPE_RAW)
+		memcpy(last, &data->payload, sizeof(*last));
+#if KNOT_THING_FILTER
+	item->last_report = hal_time_ms();
+#endif
+
+	return comparison;
+}
+
+#if KNOT_THING_AGGREGATE
+static inline int32_t clamp_i32(int64_t val)
+{
+	if (val > INT32_MAX)
+		return INT32_MAX;
+	if (val < INT32_MIN)
+		return INT32_MIN;
+
+	return val;
+}
+
+/*
+ * Adds the value read to the window of the item, at most once every
+ * KNOT_THING_POLL_MS however often the loop sweeps. The report closing
+ * the window, raised by KNOT_EVT_FLAG_TIME, always counts its own value
+ * and carries the statistic of all the samples instead of it.
+ */
+static void item_aggregate(struct _data_items *item, knot_msg_data *data,
+							uint8_t comparison)
+{
+	struct aggregate *agg = &item->agg;
+	knot_data *val = &data->payload;
+	uint32_t now;
+
+	if (agg->mode == KNOT_THING_AGG_NONE)
+		return;
+
+	now = hal_time_ms();
+	if (agg->count && !(comparison & KNOT_EVT_FLAG_TIME) &&
+				now - agg->sample_time < KNOT_THING_POLL_MS)
+		return;
+
+	agg->sample_time = now;
+
+	if (item->value_type == KNOT_VALUE_TYPE_INT) {
+		if (agg->count == 0 || val->val_i < agg->min.val_i)
+			agg->min.val_i = val->val_i;
+		if (agg->count == 0 || val->val_i > agg->max.val_i)
+			agg->max.val_i = val->val_i;
+		agg->sum.val_i += val->val_i;
+	} else {
+		if (agg->count == 0 || val->val_f < agg->min.val_f)
+			agg->min.val_f = val->val_f;
+		if (agg->count == 0 || val->val_f > agg->max.val_f)
+			agg->max.val_f = val->val_f;
+		agg->sum.val_f += val->val_f;
+	}
+
+	agg->count++;
+
+	if (!(comparison & KNOT_EVT_FLAG_TIME))
+		return;
+
+	switch (agg->mode) {
+	case KNOT_THING_AGG_MIN:
+		memcpy(val, &agg->min, sizeof(agg->min));
+		break;
+	case KNOT_THING_AGG_MAX:
+		memcpy(val, &agg->max, sizeof(agg->max));
+		break;
+	case KNOT_THING_AGG_MEAN:
+		if (item->value_type == KNOT_VALUE_TYPE_INT)
+			val->val_i = agg->sum.val_i / agg->count;
+		else
+			val->val_f = agg->sum.val_f / agg->count;
+		break;
+	case KNOT_THING_AGG_SUM:
+		if (item->value_type == KNOT_VALUE_TYPE_INT)
+			val->val_i = clamp_i32(agg->sum.val_i);
+		else
+			val->val_f = agg->sum.val_f;
+		break;
+	case KNOT_THING_AGG_COUNT:
+		if (item->value_type == KNOT_VALUE_TYPE_INT)
+			val->val_i = clamp_i32(agg->count);
+		else
+			val->val_f = agg->count;
+		break;
+	}
+
+	agg->count = 0;
+	memset(&agg->sum, 0, sizeof(agg->sum));
+}
+#endif
+
+/* Whether change and limit events still wait for the minimum interval */
+static inline uint8_t item_held(const struct _data_items *item,
+							uint8_t comparison)
+{
+#if KNOT_THING_FILTER
+	return !comparison && item->filter.min_interval_ms &&
+		hal_time_ms() - item->last_report < item->filter.min_interval_ms;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Compares a value read and returns the events it raised, starting from
+ * the ones in comparison. A held item is only sampled for its window.
+ */
+static uint8_t item_check(struct _data_items *item, knot_msg_data *data,
+							uint8_t comparison)
+{
+	if (!item_held(item, comparison))
+		comparison = item_compare(item, data, comparison);
+
+#if KNOT_THING_AGGREGATE
+	item_aggregate(item, data, comparison);
+#endif
+
+	return comparison;
+}
+
+/*
+ * Reads the item into data and returns the events it raised, starting
+ * from the ones in comparison. 0 means there is nothing to send.
+ */
+static uint8_t item_evaluate(struct _data_items *item, knot_msg_data *data,
+							uint8_t comparison)
+{
+	/* Held items are still read while their window needs samples */
+	if (item_held(item, comparison)) {
+#if KNOT_THING_AGGREGATE
+		if (item->agg.mode == KNOT_THING_AGG_NONE)
+			return 0;
+#else
+		return 0;
+#endif
 	}
 
+	data->hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+	data->sensor_id = item->id;
+
+	if (item_read(item, data, comparison ?
+			ASYNC_EVENT | ASYNC_TIME : ASYNC_EVENT) < 0)
+		return 0;
+
+	return item_check(item, data, comparison);
+}
+
+#if KNOT_THING_ASYNC
+/* Checks the reads completed for knot_thing_verify_events() */
+static int8_t async_events(knot_msg_data *data)
+{
+	struct _data_items *item;
+	struct async_op *op;
+	uint8_t i, comparison;
+
+	async_expire();
+
+	for (i = 0; i < KNOT_THING_ASYNC; i++) {
+		op = &async_ops[i];
+		if ((op->flags & (ASYNC_DONE | ASYNC_EVENT)) !=
+						(ASYNC_DONE | ASYNC_EVENT))
+			continue;
+
+		comparison = op->flags & ASYNC_TIME ? KNOT_EVT_FLAG_TIME : 0;
+		op->flags &= ~(ASYNC_EVENT | ASYNC_TIME);
+
+		item = find_item(op->id);
+		if (item && op->data.hdr.type == KNOT_MSG_PUSH_DATA_REQ) {
+			memcpy(data, &op->data, sizeof(*data));
+			comparison = item_check(item, data, comparison);
+		} else {
+			comparison = 0;
+		}
+
+		async_release(op);
+		if (comparison)
+			return 0;
+	}
+
+	return -1;
+}
+#endif
+
+int knot_thing_verify_events(knot_msg_data *data)
+{
+	struct _data_items *item;
+	uint8_t comparison;
+	/* Current time in miliseconds to verify sensor timeout */
+	uint32_t current_time;
+
+	if (item_count == 0)
+		return -1;
+
+#if KNOT_THING_ASYNC
+	/* Values that arrived since the last call go first */
+	if (async_events(data) == 0)
+		return 0;
+#endif
+
+	current_time = hal_time_ms();
+
 	/*
-	 * It is checked if the data is in time to be updated (time overflow).
-	 * If yes, the last timeout value and the comparison variable are updated with the time flag.
+	 * One item is checked per call; with KNOT_THING_FULL_SWEEP the call
+	 * goes on until an event is found or the sweep is over, so calling
+	 * it until it fails covers the whole table.
 	 */
-	current_time = hal_time_ms();
-	if (hal_timeout(current_time, item->last_timeout,
-			(item->config.time_sec * 1000)) > 0) {
-		item->last_timeout = current_time;
-		comparison |= (KNOT_EVT_FLAG_TIME & item->config.event_flags);
-	}
+	do {
+		/*
+		 * An item whose report is due goes first; the timer is
+		 * restarted even if the read fails so a broken sensor
+		 * doesn't hog the loop.
+		 */
+		if (timer_count &&
+			!deadline_before(current_time, timer_deadline(0))) {
+			item = &data_items[timer_heap[0]];
+			timer_schedule(timer_heap[0], current_time);
+			comparison = KNOT_EVT_FLAG_TIME;
+		} else {
+			/*
+			 * Otherwise poll the next item watched for change or
+			 * limit events, in priority order, skipping time only
+			 * items. The call that reaches the end of the table
+			 * closes the sweep.
+			 */
+			item = sweep_next(current_time);
+			if (!item)
+				return -1;
+
+			comparison = 0;
+		}
 
-none:
-	/* Wrap or increment to the next item */
-	pos_count = (pos_count + 1) > last_item ? 0 : pos_count + 1;
+		comparison = item_evaluate(item, data, comparison);
+	} while (comparison == 0 && KNOT_THING_FULL_SWEEP);
 
 	/* Nothing changed */
 	if (comparison == 0)
@@ -495,6 +1547,47 @@ none:
 	return 0;
 }
 
+uint32_t knot_thing_run_tickless(void)
+{
+	loop_run();
+
+	return knot_thing_protocol_next_ms();
+}
+
+uint32_t knot_thing_next_event_ms(void)
+{
+	uint32_t now = hal_time_ms(), next = UINT32_MAX, elapsed;
+#if KNOT_THING_ASYNC
+	uint8_t i;
+
+	for (i = 0; i < KNOT_THING_ASYNC; i++)
+		if (async_ops[i].flags & ASYNC_DONE)
+			return 0;
+#endif
+
+	if (timer_count) {
+		if (!deadline_before(now, timer_deadline(0)))
+			return 0;
+
+		next = timer_deadline(0) - now;
+	}
+
+	if (watch_count == 0)
+		return next;
+
+	/* A sweep in progress continues on the next call */
+	if (!sweep_idle)
+		return 0;
+
+	elapsed = now - sweep_time;
+	if (elapsed >= KNOT_THING_POLL_MS)
+		return 0;
+
+	elapsed = KNOT_THING_POLL_MS - elapsed;
+
+	return elapsed < next ? elapsed : next;
+}
+
 int8_t knot_thing_init(const char *thing_name)
 {
 	reset_data_items();
@@ -504,12 +1597,27 @@ int8_t knot_thing_init(const char *thing_name)
 
 uint8_t knot_thing_get_sensor_id(const uint8_t index)
 {
-	if (index >= KNOT_THING_DATA_MAX) {
+	if (index >= item_count) {
 		return 0;
 	}
 	return data_items[index].id;
 }
 
+uint8_t knot_thing_get_item_count(void)
+{
+	return item_count;
+}
+
+void knot_thing_get_ram_usage(knot_thing_ram_usage *usage)
+{
+	usage->item_bytes = sizeof(data_items[0]) + sizeof(item_schema[0]) +
+			sizeof(id_index[0]) + sizeof(timer_heap[0]) +
+			sizeof(sweep_order[0]);
+	usage->items = item_count;
+	usage->slots = KNOT_THING_DATA_MAX;
+	usage->total_bytes = usage->item_bytes * KNOT_THING_DATA_MAX;
+}
+
 uint8_t knot_thing_get_value_type(const uint8_t sensor_id)
 {
 	struct _data_items *item = find_item(sensor_id);
@@ -519,3 +1627,187 @@ uint8_t knot_thing_get_value_type(const uint8_t sensor_id)
 
 	return item->value_type;
 }
+
+void knot_thing_get_stats(knot_thing_stats *stats)
+{
+#if KNOT_THING_STATS
+	uint8_t i;
+#endif
+
+	knot_thing_protocol_stats(stats);
+
+#if KNOT_THING_STATS
+	for (i = 0; i < item_count; i++) {
+		stats->events_sent += data_items[i].events_sent;
+		stats->events_suppressed += data_items[i].events_suppressed;
+	}
+#endif
+}
+
+int knot_thing_get_item_stats(uint8_t id, knot_thing_item_stats *stats)
+{
+#if KNOT_THING_STATS
+	struct _data_items *item = find_item(id);
+
+	if (!item || !stats)
+		return -1;
+
+	stats->events_sent = item->events_sent;
+	stats->events_suppressed = item->events_suppressed;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int knot_thing_stats_read(uint8_t *buffer, uint8_t len)
+{
+#if KNOT_THING_STATS
+	knot_thing_stats stats;
+	uint32_t now = hal_time_ms();
+
+	if (len < sizeof(stats_raw))
+		return -1;
+
+	/* A new snapshot per period: the item changes at most that often */
+	if (!stats_raw_valid ||
+			now - stats_raw_time >= KNOT_THING_STATS_PERIOD_MS) {
+		knot_thing_get_stats(&stats);
+		stats_raw.frames_sent = stats.frames_sent;
+		stats_raw.frames_received = stats.frames_received;
+		stats_raw.write_errors = stats.write_errors;
+		stats_raw.retransmits = stats.retransmits + stats.schema_retries;
+		stats_raw.link_losses = stats.link_losses;
+		stats_raw.errors = stats.errors;
+		stats_raw.events_sent = stats.events_sent;
+		stats_raw.events_suppressed = stats.events_suppressed;
+		stats_raw_time = now;
+		stats_raw_valid = 1;
+	}
+
+	memcpy(buffer, &stats_raw, sizeof(stats_raw));
+
+	return sizeof(stats_raw);
+#else
+	return -1;
+#endif
+}
+
+void knot_thing_get_loop_profile(knot_thing_profile *profile)
+{
+#if KNOT_THING_PROFILE
+	profile_copy(&loop_profile, profile);
+#else
+	memset(profile, 0, sizeof(*profile));
+#endif
+}
+
+int knot_thing_get_item_profile(uint8_t id, knot_thing_profile *profile)
+{
+#if KNOT_THING_PROFILE
+	struct _data_items *item = find_item(id);
+
+	if (!item || !profile)
+		return -1;
+
+	profile_copy(&item->profile, profile);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void knot_thing_reset_profile(void)
+{
+#if KNOT_THING_PROFILE
+	uint8_t i;
+
+	profile_reset(&loop_profile);
+	for (i = 0; i < item_count; i++)
+		profile_reset(&data_items[i].profile);
+#endif
+}
+
+int knot_thing_complete_read(uint8_t id, const void *value, uint8_t len)
+{
+#if KNOT_THING_ASYNC
+	struct async_op *op = async_find(id, ASYNC_READ);
+	struct _data_items *item = find_item(id);
+
+	if (!op || !item || (op->flags & ASYNC_DONE))
+		return -1;
+
+	if (!value) {
+		async_fail(op);
+		return 0;
+	}
+
+	if (item->value_type == KNOT_VALUE_TYPE_RAW ?
+			len > value_len(item) : len != value_len(item))
+		return -1;
+
+	op->data.hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+	op->data.hdr.payload_len = sizeof(op->data.sensor_id) + len;
+	op->data.sensor_id = id;
+	memcpy(&op->data.payload, value, len);
+	op->flags |= ASYNC_DONE;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int knot_thing_complete_write(uint8_t id, int result)
+{
+#if KNOT_THING_ASYNC
+	struct async_op *op = async_find(id, ASYNC_WRITE);
+	struct _data_items *item = find_item(id);
+
+	if (!op || !item || (op->flags & ASYNC_DONE))
+		return -1;
+
+	/* Raw write functions return the length written */
+	if (result < 0 || (item->value_type == KNOT_VALUE_TYPE_RAW &&
+						result > KNOT_DATA_RAW_SIZE)) {
+		async_fail(op);
+		return 0;
+	}
+
+	op->data.hdr.type = KNOT_MSG_PUSH_DATA_RSP;
+	op->data.hdr.payload_len = sizeof(op->data.sensor_id) +
+		(item->value_type == KNOT_VALUE_TYPE_RAW ? result :
+							value_len(item));
+	op->flags |= ASYNC_DONE;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int knot_thing_async_reply(knot_msg_data *data)
+{
+#if KNOT_THING_ASYNC
+	struct async_op *op;
+	uint8_t i;
+
+	async_expire();
+
+	for (i = 0; i < KNOT_THING_ASYNC; i++) {
+		op = &async_ops[i];
+		if (!(op->flags & ASYNC_DONE) ||
+				!(op->flags & (ASYNC_POLL | ASYNC_WRITE)))
+			continue;
+
+		memcpy(data, &op->data, sizeof(*data));
+		op->flags &= ~(ASYNC_POLL | ASYNC_WRITE);
+		async_release(op);
+
+		return 0;
+	}
+#endif
+	return -1;
+}
@@ -24,6 +24,13 @@ typedef int (*boolDataFunction)		(uint8_t *val);
 typedef int (*rawReadFunction)		(uint8_t *buffer, uint8_t len);
 typedef int (*rawWriteFunction)		(const uint8_t *buffer, uint8_t len);
 
+/*
+ * Returned by a read or write function that finishes later, with
+ * knot_thing_complete_read() or knot_thing_complete_write(); needs
+ * KNOT_THING_ASYNC, otherwise it is taken as a failure.
+ */
+#define KNOT_THING_PENDING		(-128)
+
 typedef struct __attribute__ ((packed)) {
 	intDataFunction read;
 	intDataFunction write;
@@ -44,18 +51,124 @@ typedef struct __attribute__ ((packed)) {
 	rawWriteFunction write;
 } knot_raw_functions;
 
+/*
+ * Functions of an int, float or bool item taking a context: val points
+ * to an int32_t, a float or a uint8_t as the item was registered.
+ */
+typedef int (*ctxDataFunction)		(void *ctx, void *val);
+
+typedef struct {
+	ctxDataFunction read;
+	ctxDataFunction write;
+} knot_ctx_ops;
+
+typedef struct __attribute__ ((packed)) {
+	const knot_ctx_ops *ops;	/* Shared by the items of a type */
+	void *ctx;
+} knot_ctx_functions;
+
 typedef union __attribute__ ((packed)) {
 	knot_int_functions	int_f;
 	knot_float_functions	float_f;
 	knot_bool_functions	bool_f;
 	knot_raw_functions	raw_f;
+	knot_ctx_functions	ctx_f;
 } knot_data_functions;
 
+/*
+ * An item of a table kept in flash (PROGMEM on AVR), registered with
+ * knot_thing_register_item_table(). The name is held inline so it never
+ * takes RAM; config is the default one, used if event_flags isn't 0.
+ * Raw items need a RAM buffer and can't be declared this way.
+ */
+typedef struct __attribute__ ((packed)) {
+	uint8_t id;
+	uint8_t value_type;		/* KNOT_VALUE_TYPE_* */
+	uint16_t type_id;		/* KNOT_TYPE_ID_* */
+	uint8_t unit;			/* KNOT_UNIT_* */
+	uint8_t priority;
+	char name[KNOT_PROTOCOL_DATA_NAME_LEN];
+	knot_config config;
+	knot_data_functions functions;
+} knot_thing_item_def;
+
+/* functions of a knot_thing_item_def, for every value type */
+#define KNOT_THING_FUNCTIONS(read, write)				\
+	{ { (intDataFunction) (read), (intDataFunction) (write) } }
+
+/*
+ * Raw item delta (KNOT_THING_RAW_DELTA): the sensor id followed by
+ * offset, length and bytes ranges to patch into the last value sent.
+ */
+#ifndef KNOT_MSG_PUSH_DELTA_REQ
+#define KNOT_MSG_PUSH_DELTA_REQ		0x22
+#endif
+
+/* knot_thing_filter flags */
+#define KNOT_THING_FILTER_PERCENT	0x01	/* Deadband in % of the last value */
+
+/*
+ * Change filter of an int or float item, in the item value type. Also
+ * accepted after the knot_config of a KNOT_MSG_PUSH_CONFIG_REQ.
+ */
+typedef struct __attribute__ ((packed)) {
+	knot_value_type deadband;	/* Largest change not reported */
+	knot_value_type hysteresis;	/* Return past a limit to re-arm it */
+	uint16_t min_interval_ms;	/* Least time between change reports */
+	uint8_t flags;			/* KNOT_THING_FILTER_* */
+} knot_thing_filter;
+
+/* Static RAM taken by the data item table */
+typedef struct {
+	uint16_t item_bytes;	/* Per slot: state, schema and index entries */
+	uint16_t total_bytes;	/* All KNOT_THING_DATA_MAX slots */
+	uint8_t items;		/* Registered items */
+	uint8_t slots;		/* KNOT_THING_DATA_MAX */
+} knot_thing_ram_usage;
+
+/* Event counters of one item, kept with KNOT_THING_STATS */
+typedef struct {
+	uint16_t events_sent;		/* Events raised, wrapping */
+	uint16_t events_suppressed;	/* Polls that read an unsent change */
+} knot_thing_item_stats;
+
+/*
+ * Value of knot_thing_stats_read(), in host byte order, each counter
+ * cut to 16 bits. retransmits adds up the schema retries.
+ */
+typedef struct __attribute__ ((packed)) {
+	uint16_t frames_sent;
+	uint16_t frames_received;
+	uint16_t write_errors;
+	uint16_t retransmits;
+	uint16_t link_losses;
+	uint16_t errors;
+	uint16_t events_sent;
+	uint16_t events_suppressed;
+} knot_thing_stats_raw;
+
+/* Durations of a hot path, kept with KNOT_THING_PROFILE */
+typedef struct {
+	uint32_t calls;		/* Timed calls, wrapping */
+	uint32_t min_us;
+	uint32_t avg_us;	/* Weighted to the most recent calls */
+	uint32_t max_us;
+	uint16_t overruns;	/* Calls over the budget, saturating */
+} knot_thing_profile;
+
 /* KNOT Thing main initialization functions and polling */
 int8_t	knot_thing_init(const char *thing_name);
 void	knot_thing_exit(void);
 int8_t	knot_thing_run(void);
 
+/*
+ * Same as knot_thing_run(), but returns the milliseconds until the thing
+ * has work again: 0 to call it right away, otherwise the caller may sleep
+ * that long. Never more than KNOT_THING_POLL_MS while the thing is
+ * waiting for the gateway or polling sensors for change events.
+ */
+uint32_t knot_thing_run_tickless(void);
+
 /*
  * Data item (source/sink) registration functions
  *
@@ -71,11 +184,79 @@ int8_t knot_thing_register_raw_data_item(uint8_t sensor_id, const char *name,
 int8_t knot_thing_register_data_item(uint8_t sensor_id, const char *name, uint16_t type_id,
 	uint8_t value_type, uint8_t unit, knot_data_functions *func);
 
+/*
+ * Registers count items of a table in flash, in order:
+ *
+ *	static const knot_thing_item_def items[] PROGMEM = {
+ *		{ 3, KNOT_VALUE_TYPE_INT, KNOT_TYPE_ID_SPEED,
+ *			KNOT_UNIT_SPEED_MS, 0, "Speed Sensor",
+ *			{ KNOT_EVT_FLAG_CHANGE, 0, {0}, {0} },
+ *			KNOT_THING_FUNCTIONS(speed_read, speed_write) },
+ *	};
+ *
+ * Returns -1 at the first item that can't be registered.
+ */
+int8_t knot_thing_register_item_table(const knot_thing_item_def *table,
+							uint8_t count);
+
+/*
+ * Registers an int, float or bool item whose functions get ctx, so one
+ * object can serve several items; ops must outlive the item.
+ */
+int8_t knot_thing_register_ctx_data_item(uint8_t sensor_id, const char *name,
+	uint16_t type_id, uint8_t value_type, uint8_t unit,
+	const knot_ctx_ops *ops, void *ctx);
+
+/* Sets the change filter; needs KNOT_THING_FILTER, int and float only */
+int knot_thing_filter_data_item(uint8_t id, const knot_thing_filter *filter);
+
+/* What the KNOT_EVT_FLAG_TIME report of an aggregated item carries */
+#define KNOT_THING_AGG_NONE		0	/* Value read at report time */
+#define KNOT_THING_AGG_MIN		1
+#define KNOT_THING_AGG_MAX		2
+#define KNOT_THING_AGG_MEAN		3
+#define KNOT_THING_AGG_SUM		4
+#define KNOT_THING_AGG_COUNT		5	/* Samples in the window */
+
+/*
+ * Samples the item on every sweep and reports one statistic of the
+ * samples taken since its previous time report; needs
+ * KNOT_THING_AGGREGATE, int and float only.
+ */
+int knot_thing_aggregate_data_item(uint8_t id, uint8_t mode);
+
+/*
+ * Items with a higher priority (0 by default) are checked first for
+ * change and limit events; equal priorities keep registration order.
+ */
+int knot_thing_set_item_priority(uint8_t id, uint8_t priority);
+
 /* Create schema for data item in position given by index if valid */
 int knot_thing_create_schema(uint8_t index, knot_msg_schema *msg);
 int knot_thing_data_item_read(uint8_t id, knot_msg_data *data);
 int knot_thing_data_item_write(uint8_t id, knot_msg_data *data);
 int knot_thing_verify_events(knot_msg_data *data);
+/* Makes the next event of every raw item a full value, not a delta */
+void knot_thing_raw_keyframe(void);
+/* Milliseconds until knot_thing_verify_events() may report an event */
+uint32_t knot_thing_next_event_ms(void);
+
+/*
+ * Completion of a read or write function that returned
+ * KNOT_THING_PENDING, to be called from the sketch loop rather than an
+ * interrupt. value holds len bytes of the item type, or the raw bytes
+ * read; NULL reports a failed read. result is what the write function
+ * would have returned. Both return -1 if no such operation is pending.
+ */
+int knot_thing_complete_read(uint8_t sensor_id, const void *value,
+							uint8_t len);
+int knot_thing_complete_write(uint8_t sensor_id, int result);
+
+/*
+ * Next answer to the gateway made ready by a completion: the value of a
+ * poll or the echo of a write. Returns -1 if there is none.
+ */
+int knot_thing_async_reply(knot_msg_data *data);
 int knot_thing_config_data_item(uint8_t id, uint8_t evflags, uint16_t time_sec,
 						knot_value_type *lower,
 						knot_value_type *upper);
@@ -90,6 +271,37 @@ uint8_t knot_thing_get_sensor_id(const uint8_t index);
 /* Get value type for given sensor id. Returns -1 if id is not registered */
 uint8_t knot_thing_get_value_type(const uint8_t sensor_id);
 
+/* Number of registered items, stored at indexes 0 to count - 1 */
+uint8_t knot_thing_get_item_count(void);
+
+/* RAM used by the item table, to size KNOT_THING_DATA_MAX */
+void knot_thing_get_ram_usage(knot_thing_ram_usage *usage);
+
+/*
+ * Runtime counters of the state machine and the items; all 0 without
+ * KNOT_THING_STATS. The item ones return -1 for an unknown id.
+ */
+void knot_thing_get_stats(knot_thing_stats *stats);
+int knot_thing_get_item_stats(uint8_t id, knot_thing_item_stats *stats);
+
+/*
+ * Raw read function serving a knot_thing_stats_raw snapshot, so the
+ * gateway can collect the counters: register it as a raw item of
+ * sizeof(knot_thing_stats_raw) bytes with KNOT_TYPE_ID_NONE.
+ */
+int knot_thing_stats_read(uint8_t *buffer, uint8_t len);
+
+/*
+ * Time taken by each knot_thing_run() pass, callbacks included, and by
+ * the read and write functions of an item; overruns count the calls
+ * over KNOT_THING_LOOP_BUDGET_US and KNOT_THING_CALLBACK_BUDGET_US. All
+ * 0 without KNOT_THING_PROFILE; the item one returns -1 then or for an
+ * unknown id.
+ */
+void knot_thing_get_loop_profile(knot_thing_profile *profile);
+int knot_thing_get_item_profile(uint8_t id, knot_thing_profile *profile);
+void knot_thing_reset_profile(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,9 +17,15 @@
 #include <hal/avr_errno.h>
 #include <hal/avr_unistd.h>
 #include <hal/avr_log.h>
+#else
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <hal/linux_log.h>
+#endif
+
 #define CLEAR_EEPROM_PIN 7
 #define PIN_LED_STATUS   6 //LED used to show thing status
-#endif
 
 #include <hal/storage.h>
 #include <hal/nrf24.h>
@@ -30,18 +36,6 @@
 #include "knot_thing_main.h"
 #include "knot_thing_config.h"
 
-/* KNoT protocol client states */
-#define STATE_DISCONNECTED		0
-#define STATE_ACCEPTING			1
-#define STATE_CONNECTED			2
-#define STATE_AUTHENTICATING		3
-#define STATE_REGISTERING		4
-#define STATE_SCHM			5
-#define STATE_SCHM_RSP		6
-#define STATE_ONLINE			7
-#define STATE_RUNNING			8
-#define STATE_ERROR			9
-
 /* Intervals for LED blinking */
 #define LONG_INTERVAL			10000
 #define SHORT_INTERVAL			1000
@@ -54,30 +48,124 @@
 /* Periods for LED blinking in HALT conditions */
 #define NAME_ERROR			50
 #define COMM_ERROR			100
-#define AUTH_ERROR			250
 
 /* Time that the clear eeprom button needs to be pressed */
 #define BUTTON_PRESSED_TIME		5000
 
-/* KNoT MTU */
-#define MTU 256
-
 #ifndef MIN
 #define MIN(a,b)			(((a) < (b)) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#define MAX(a,b)			(((a) > (b)) ? (a) : (b))
+#endif
+
+/* Largest message held by the outbound queue */
+#if KNOT_THING_OFFLINE_SAMPLES
+#define TX_MSG_MAX			sizeof(knot_thing_msg_aged)
+#else
+#define TX_MSG_MAX			sizeof(knot_msg_data)
+#endif
+
+#if KNOT_THING_STATS
+#define STAT_INC(field)			(stats.field++)
+#else
+#define STAT_INC(field)
+#endif
+
 /* Retransmission timeout in ms */
 #define RETRANSMISSION_TIMEOUT				20000
 
-static knot_msg msg;
+/*
+ * A schema round times out after SCHM_RTO_MUL times the smoothed
+ * response time, at least SCHM_RTO_MIN ms, doubled on each timeout in a
+ * row up to SCHM_BACKOFF_MAX times and never over RETRANSMISSION_TIMEOUT.
+ */
+#define SCHM_RTO_MUL			4
+#define SCHM_RTO_MIN			100
+#define SCHM_BACKOFF_MAX		8
+
+/*
+ * Inbound and outbound messages have their own buffers, so a gateway
+ * request can be read and answered while an event is being built. A
+ * reply that echoes the request is encoded in place in rx_msg, then
+ * copied into the outbound queue like any other message. rx_msg
+ * takes a whole knot_msg (128 bytes) so any gateway message fits;
+ * tx_msg only holds what the thing sends, up to the 78 bytes of the
+ * authentication request. Link events are read into rx_msg as well, so
+ * no message buffer is put on the stack.
+ */
+static knot_msg rx_msg;
+/* Result of this call's read of the data socket into rx_msg */
+static ssize_t rx_len;
+static uint32_t mgmt_time;
+static union {
+	knot_msg_header hdr;
+	knot_msg_register reg;
+	knot_msg_authentication auth;
+	knot_msg_schema schema;
+	knot_msg_data data;
+#if KNOT_THING_OFFLINE_SAMPLES
+	knot_thing_msg_aged aged;
+#endif
+} tx_msg;
 static struct nrf24_config config = { .mac = 0, .channel = 76 , .name = NULL};
 static unsigned long clear_time;
 static uint32_t last_timeout;
 static uint32_t unreg_timeout;
 static int sock = -1;
 static int cli_sock = -1;
-static bool schema_flag = false;
 static uint8_t enable_run = 0, msg_sensor_index = 0;
+/* Schema round: fragments sent and acknowledged */
+static uint8_t schm_sent = 0, schm_acked = 0;
+/* Item index and send time (low 16 bits) of each fragment of the round */
+static struct {
+	uint8_t index;
+	uint16_t time;
+} schm_frag[KNOT_THING_SCHEMA_WINDOW];
+/* Responses still owed for fragments of a superseded round */
+static uint8_t schm_stale;
+/* Smoothed request to response time in ms, 0 until measured */
+static uint16_t schm_rtt;
+static uint8_t schm_backoff;
+/* Items whose schema fragment must be sent, one bit per item index */
+static uint8_t schm_pending[(KNOT_THING_DATA_MAX + 7) / 8];
+/* Gateway known to have the schema of the first schm_items items */
+static uint8_t schm_synced, schm_items;
+#if KNOT_THING_CRED_CACHE
+/* Credentials as stored, once read or received */
+static struct {
+	char uuid[KNOT_PROTOCOL_UUID_LEN];
+	char token[KNOT_PROTOCOL_TOKEN_LEN];
+} cred;
+static uint8_t cred_cached;
+#endif
+#if KNOT_THING_RESUME_MS
+/* Link lost while running, with nothing to send left behind */
+static uint8_t resume;
+static uint32_t resume_time;
+#endif
+static uint8_t run_state = STATE_DISCONNECTED;
+#if KNOT_THING_BATCH_MTU
+/* Data messages waiting to share one frame and when the first came */
+static uint8_t batch[KNOT_THING_BATCH_MTU];
+static uint8_t batch_len;
+static uint32_t batch_time;
+#endif
+/* Status LED: last toggle and time until the next one */
+static uint32_t led_time;
+static uint16_t led_interval;
+/* LED blink period while the thing can't run, 0 otherwise */
+static uint16_t halt_period;
+static uint8_t halt_led;
+#if KNOT_THING_STATS
+static knot_thing_stats stats;
+/* Last time spent in the state machine was accounted */
+static uint32_t stats_time;
+#endif
+/* No listening before retry_wait ms from retry_time; failures in a row */
+static uint32_t retry_time, retry_wait;
+static uint8_t retry_count;
 
 /*
  * FIXME: Thing address should be received via NFC
@@ -93,10 +181,22 @@ static void set_nrf24MAC(void)
 						sizeof(struct nrf24_mac));
 }
 
+/* The stored credentials are about to go: don't keep a copy */
+static inline void cred_forget(void)
+{
+#if KNOT_THING_CRED_CACHE
+	cred_cached = 0;
+#endif
+#if KNOT_THING_RESUME_MS
+	resume = 0;
+#endif
+}
+
 static void thing_disconnect_exit(void)
 {
 	/* reset EEPROM (UUID/Token) and generate new MAC addr */
 	hal_storage_reset_end();
+	cred_forget();
 	set_nrf24MAC();
 
 	/* close connection */
@@ -121,15 +221,121 @@ static void verify_clear_data(void)
 
 }
 
-static void halt_blinking_led(uint32_t period)
+/*
+ * Schedules the next attempt to listen. The n-th failure in a row waits
+ * a random time between half and all of KNOT_THING_RETRY_MIN_MS doubled
+ * n - 1 times, up to KNOT_THING_RETRY_MAX_MS, so things failing together
+ * don't come back in step.
+ */
+static void retry_backoff(void)
 {
-	while (1) {
-		hal_gpio_digital_write(PIN_LED_STATUS, 0);
-		hal_delay_ms(period);
-		hal_gpio_digital_write(PIN_LED_STATUS, 1);
-		hal_delay_ms(period);
-		verify_clear_data();
-	}
+	uint32_t wait = KNOT_THING_RETRY_MIN_MS, rnd;
+	uint8_t i;
+
+	for (i = 0; i < retry_count && wait < KNOT_THING_RETRY_MAX_MS; i++)
+		wait <<= 1;
+
+	if (wait > KNOT_THING_RETRY_MAX_MS)
+		wait = KNOT_THING_RETRY_MAX_MS;
+
+	if (retry_count < UINT8_MAX)
+		retry_count++;
+
+	hal_getrandom(&rnd, sizeof(rnd));
+	retry_wait = wait - rnd % (wait / 2 + 1);
+	retry_time = hal_time_ms();
+}
+
+/*
+ * Stops the state machine; knot_thing_run() returns at once and blinks
+ * the LED with the period given, so the sketch keeps running.
+ */
+static void halt_blinking_led(uint16_t period)
+{
+	halt_period = period;
+	enable_run = 0;
+}
+
+static int init_connection(void);
+
+/* Random wait before listening at start and after the link was lost */
+static void retry_jitter(void)
+{
+	retry_wait = 0;
+	retry_time = hal_time_ms();
+#if KNOT_THING_LISTEN_JITTER_MS
+	hal_getrandom(&retry_wait, sizeof(retry_wait));
+	retry_wait %= KNOT_THING_LISTEN_JITTER_MS;
+#endif
+}
+
+static void halt_blink(void)
+{
+	uint32_t now = hal_time_ms();
+
+	if (halt_period == 0 || now - led_time < halt_period)
+		return;
+
+	led_time = now;
+	halt_led = !halt_led;
+	hal_gpio_digital_write(PIN_LED_STATUS, halt_led);
+
+	/* The radio did not start: try again once the backoff is over */
+	if (halt_period == COMM_ERROR &&
+			hal_timeout(now, retry_time, retry_wait) > 0)
+		init_connection();
+}
+
+static void schema_restart(uint8_t index)
+{
+	msg_sensor_index = index;
+	schm_sent = 0;
+	schm_acked = 0;
+}
+
+static void schema_rtt_sample(uint16_t ms)
+{
+	if (schm_rtt == 0)
+		schm_rtt = MAX(ms, 1);
+	else
+		schm_rtt = ((uint32_t) schm_rtt * 7 + ms + 7) / 8;
+}
+
+/* A new upload; the request just answered gives a first response time */
+static void schema_start(void)
+{
+	schema_rtt_sample(hal_time_ms() - last_timeout);
+	schm_backoff = 0;
+	schm_stale = 0;
+	schema_restart(0);
+}
+
+static uint32_t schema_timeout(void)
+{
+	uint32_t timeout;
+
+	if (schm_rtt == 0)
+		return RETRANSMISSION_TIMEOUT;
+
+	timeout = MAX((uint32_t) schm_rtt * SCHM_RTO_MUL, SCHM_RTO_MIN);
+
+	return MIN(timeout << schm_backoff, RETRANSMISSION_TIMEOUT);
+}
+
+/*
+ * Sends the round again from its first fragment not acknowledged. After
+ * an error the GW still answers the rest of the round, in order, so
+ * those owed responses come before any to the new fragments and are
+ * dropped; if one of them was lost, an ack of the new round is dropped
+ * instead and the round times out. After a timeout, several response
+ * times long, nothing more is expected from the round.
+ */
+static void schema_resume(uint8_t owed)
+{
+	STAT_INC(schema_retries);
+	schm_stale = owed;
+	schema_restart(schm_acked < schm_sent ?
+			schm_frag[schm_acked].index : msg_sensor_index);
 }
 
 static int init_connection(void)
@@ -142,17 +348,37 @@ static int init_connection(void)
 	hal_log_str(macString);
 #endif
 	if (hal_comm_init("NRF0", &config) < 0)
-		halt_blinking_led(COMM_ERROR);
+		goto comm_error;
 
 	sock = hal_comm_socket(HAL_COMM_PF_NRF24, HAL_COMM_PROTO_RAW);
-	if (sock < 0)
-		halt_blinking_led(COMM_ERROR);
+	if (sock < 0) {
+		hal_comm_deinit();
+		goto comm_error;
+	}
+
+	retry_count = 0;
+	retry_jitter();
+	schm_synced = 0;
+	schm_rtt = 0;
+#if KNOT_THING_STATS
+	stats_time = hal_time_ms();
+#endif
 
 	clear_time = 0;
+	halt_period = 0;
 	enable_run = 1;
 	last_timeout = 0;
+	unreg_timeout = 0;
+	schema_restart(0);
+	run_state = STATE_DISCONNECTED;
 
 	return 0;
+
+comm_error:
+	retry_backoff();
+	halt_blinking_led(COMM_ERROR);
+
+	return -1;
 }
 
 int knot_thing_protocol_init(const char *thing_name)
@@ -160,11 +386,16 @@ int knot_thing_protocol_init(const char *thing_name)
 	hal_gpio_pin_mode(PIN_LED_STATUS, OUTPUT);
 	hal_gpio_pin_mode(CLEAR_EEPROM_PIN, INPUT_PULLUP);
 
-	if (thing_name == NULL)
+	if (thing_name == NULL) {
 		halt_blinking_led(NAME_ERROR);
+		return -1;
+	}
 
 	config.name = (const char *) thing_name;
 
+	/* Storage may have been changed behind our back: read it again */
+	cred_forget();
+
 	/* Set mac address if it's invalid on eeprom */
 	hal_storage_read_end(HAL_STORAGE_ID_MAC, &config.mac,
 						sizeof(struct nrf24_mac));
@@ -175,6 +406,9 @@ int knot_thing_protocol_init(const char *thing_name)
 	}
 
 	config.id = config.mac.address.uint64;
+#if KNOT_THING_STATS
+	memset(&stats, 0, sizeof(stats));
+#endif
 
 	return init_connection();
 }
@@ -194,8 +428,6 @@ void knot_thing_protocol_exit(void)
  */
 static void led_status(uint8_t status)
 {
-	static uint32_t previous_status_time = 0;
-	static uint16_t status_interval;
 	static uint8_t nblink, led_state, previous_led_state = LOW;
 	uint32_t current_status_time = hal_time_ms();
 
@@ -205,7 +437,7 @@ static void led_status(uint8_t status)
 	 */
 	if (nblink >= (status * 2)) {
 		nblink = 0;
-		status_interval = LONG_INTERVAL;
+		led_interval = LONG_INTERVAL;
 		hal_gpio_digital_write(PIN_LED_STATUS, 0);
 	}
 
@@ -218,26 +450,185 @@ static void led_status(uint8_t status)
 		led_state = LOW;
 	}
 
-	if ((current_status_time - previous_status_time) >= status_interval) {
-		previous_status_time = current_status_time;
+	if ((current_status_time - led_time) >= led_interval) {
+		led_time = current_status_time;
 		led_state = !led_state;
 		hal_gpio_digital_write(PIN_LED_STATUS, led_state);
 
 		nblink++;
-		status_interval = SHORT_INTERVAL;
+		led_interval = SHORT_INTERVAL;
 	}
 }
 
 
 
+static uint16_t crc16(uint16_t crc, const uint8_t *data, uint8_t len)
+{
+	uint8_t i;
+
+	/* CRC-16/CCITT */
+	while (len--) {
+		crc ^= (uint16_t) *data++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+/*
+ * Digest of the fragment sent for the item at index, or 0 if there is no
+ * item. The name is zero padded by knot_thing_create_schema(), so the
+ * whole fragment can be hashed as is.
+ */
+static uint16_t schema_digest(uint8_t index)
+{
+	knot_msg_schema frag;
+	uint16_t crc;
+
+	if (knot_thing_create_schema(index, &frag) < 0)
+		return 0;
+
+	crc = crc16(0xffff, &frag.sensor_id, sizeof(frag.sensor_id));
+	crc = crc16(crc, (const uint8_t *) &frag.values, sizeof(frag.values));
+
+	return crc ? crc : 1;
+}
+
+static inline uint8_t schema_is_pending(uint8_t index)
+{
+	if (index >= KNOT_THING_DATA_MAX)
+		return 0;
+
+	return schm_pending[index >> 3] & (1 << (index & 7));
+}
+
+static void schema_mark_all(void)
+{
+	memset(schm_pending, 0xff, sizeof(schm_pending));
+}
+
+/*
+ * The cache stores, at KNOT_THING_SCHEMA_STORAGE_ADDR, the number of
+ * entries followed by the digest of each item index as of the last
+ * acknowledged upload. A count other than KNOT_THING_DATA_MAX means
+ * there is no valid cache.
+ */
+static void schema_invalidate(void)
+{
+	uint8_t count = 0;
+
+	schm_synced = 0;
+
+	hal_storage_write(KNOT_THING_SCHEMA_STORAGE_ADDR, &count,
+							sizeof(count));
+}
+
+/*
+ * Marks the fragments that differ from the cache and returns how many
+ * must be sent. The gateway commits the schema on the end fragment, so
+ * the last item is always sent when anything changed; unless the
+ * gateway merges fragments (KNOT_THING_SCHEMA_DELTA) or an item was
+ * removed, any change resends the whole schema.
+ */
+static uint8_t schema_check(void)
+{
+	uint16_t addr = KNOT_THING_SCHEMA_STORAGE_ADDR + 1;
+	uint16_t digest, stored;
+	uint8_t count, index, last = 0, changed = 0, removed = 0;
+
+	memset(schm_pending, 0, sizeof(schm_pending));
+
+	/*
+	 * Items are only ever added, so the schema checked or uploaded on
+	 * an earlier link holds while no item was registered since.
+	 */
+	if (schm_synced && schm_items == knot_thing_get_item_count())
+		return 0;
+
+	hal_storage_read(KNOT_THING_SCHEMA_STORAGE_ADDR, &count, sizeof(count));
+
+	for (index = 0; index < KNOT_THING_DATA_MAX; index++,
+						addr += sizeof(stored)) {
+		digest = schema_digest(index);
+		if (digest)
+			last = index;
+
+		stored = 0;
+		if (count == KNOT_THING_DATA_MAX)
+			hal_storage_read(addr, (uint8_t *) &stored,
+							sizeof(stored));
+		else if (digest)
+			stored = ~digest;
+
+		if (stored == digest)
+			continue;
+
+		if (!digest)
+			removed = 1;
+
+		schm_pending[index >> 3] |= 1 << (index & 7);
+		changed++;
+	}
+
+	if (!changed) {
+		schm_synced = 1;
+		schm_items = knot_thing_get_item_count();
+		return 0;
+	}
+
+	if (!KNOT_THING_SCHEMA_DELTA || removed)
+		schema_mark_all();
+
+	schm_pending[last >> 3] |= 1 << (last & 7);
+
+	return changed;
+}
+
+/* Stores the digests of the fragments acknowledged by the gateway */
+static void schema_commit(void)
+{
+	uint16_t addr = KNOT_THING_SCHEMA_STORAGE_ADDR + 1;
+	uint16_t digest;
+	uint8_t count = KNOT_THING_DATA_MAX, index;
+
+	for (index = 0; index < KNOT_THING_DATA_MAX; index++,
+						addr += sizeof(digest)) {
+		if (!schema_is_pending(index))
+			continue;
+
+		digest = schema_digest(index);
+		hal_storage_write(addr, (const uint8_t *) &digest,
+							sizeof(digest));
+	}
+
+	hal_storage_write(KNOT_THING_SCHEMA_STORAGE_ADDR, &count,
+							sizeof(count));
+	schm_synced = 1;
+	schm_items = knot_thing_get_item_count();
+}
+
+/* Writes a frame on the data socket, counting it */
+static ssize_t link_write(const void *buffer, size_t count)
+{
+	ssize_t ret = hal_comm_write(cli_sock, buffer, count);
+
+	if (ret < 0)
+		STAT_INC(write_errors);
+	else
+		STAT_INC(frames_sent);
+
+	return ret;
+}
+
 static int send_unregister(void)
 {
 	/* send KNOT_MSG_UNREG_RSP message */
-	msg.hdr.type = KNOT_MSG_UNREG_RSP;
-	msg.hdr.payload_len = 0;
+	tx_msg.hdr.type = KNOT_MSG_UNREG_RSP;
+	tx_msg.hdr.payload_len = 0;
 
-	if (hal_comm_write(cli_sock, &msg,
-			   sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
+	if (link_write(&tx_msg,
+			sizeof(tx_msg.hdr) + tx_msg.hdr.payload_len) < 0)
 		return -1;
 
 	unreg_timeout = hal_time_ms();
@@ -252,17 +643,17 @@ static int send_register(void)
 	 * to avoid frame segmentation. Re-transmission may happen
 	 * frequently at noisy environments or if the remote is not ready.
 	 */
-	uint8_t name_len = NRF24_MTU - (sizeof(msg.reg.hdr) +
-						sizeof(msg.reg.id));
+	uint8_t name_len = NRF24_MTU - (sizeof(tx_msg.reg.hdr) +
+						sizeof(tx_msg.reg.id));
 
 	name_len = MIN(name_len, strlen(config.name));
-	msg.hdr.type = KNOT_MSG_REG_REQ;
-	msg.reg.id = config.mac.address.uint64; /* Maps id to nRF24 MAC */
-	strncpy(msg.reg.devName, config.name, name_len);
-	msg.hdr.payload_len = name_len + sizeof(msg.reg.id);
+	tx_msg.hdr.type = KNOT_MSG_REG_REQ;
+	tx_msg.reg.id = config.mac.address.uint64; /* Maps id to nRF24 MAC */
+	strncpy(tx_msg.reg.devName, config.name, name_len);
+	tx_msg.hdr.payload_len = name_len + sizeof(tx_msg.reg.id);
 
-	if (hal_comm_write(cli_sock, &msg,
-			   sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
+	if (link_write(&tx_msg,
+			sizeof(tx_msg.hdr) + tx_msg.hdr.payload_len) < 0)
 		return -1;
 
 	return 0;
@@ -270,45 +661,49 @@ static int send_register(void)
 
 static int read_register(void)
 {
-	ssize_t nbytes;
-
-	nbytes = hal_comm_read(cli_sock, &msg, sizeof(msg));
-	if (nbytes <= 0)
-		return nbytes;
+	if (rx_len <= 0)
+		return rx_len;
 
-	if (msg.hdr.type == KNOT_MSG_UNREG_REQ) {
+	if (rx_msg.hdr.type == KNOT_MSG_UNREG_REQ) {
 		return send_unregister();
 	}
 
-	if (msg.hdr.type != KNOT_MSG_REG_RSP)
+	if (rx_msg.hdr.type != KNOT_MSG_REG_RSP)
 		return -1;
 
-	if (msg.cred.result != 0)
+	if (rx_msg.cred.result != 0)
 		return -1;
 
-	hal_storage_write_end(HAL_STORAGE_ID_UUID, msg.cred.uuid,
+	hal_storage_write_end(HAL_STORAGE_ID_UUID, rx_msg.cred.uuid,
 			      KNOT_PROTOCOL_UUID_LEN);
-	hal_storage_write_end(HAL_STORAGE_ID_TOKEN, msg.cred.token,
+	hal_storage_write_end(HAL_STORAGE_ID_TOKEN, rx_msg.cred.token,
 			      KNOT_PROTOCOL_TOKEN_LEN);
+#if KNOT_THING_CRED_CACHE
+	memcpy(cred.uuid, rx_msg.cred.uuid, sizeof(cred.uuid));
+	memcpy(cred.token, rx_msg.cred.token, sizeof(cred.token));
+	cred_cached = 1;
+#endif
+
+	/* New identity: the gateway knows nothing about our schema */
+	schema_invalidate();
+	schema_mark_all();
+
 	return 0;
 }
 
 static int read_auth(void)
 {
-	ssize_t nbytes;
+	if (rx_len <= 0)
+		return rx_len;
 
-	nbytes = hal_comm_read(cli_sock, &msg, sizeof(msg));
-	if (nbytes <= 0)
-		return nbytes;
-
-	if (msg.hdr.type == KNOT_MSG_UNREG_REQ) {
+	if (rx_msg.hdr.type == KNOT_MSG_UNREG_REQ) {
 		return send_unregister();
 	}
 
-	if (msg.hdr.type != KNOT_MSG_AUTH_RSP)
+	if (rx_msg.hdr.type != KNOT_MSG_AUTH_RSP)
 		return -1;
 
-	if (msg.action.result != 0)
+	if (rx_msg.action.result != 0)
 		return -1;
 
 	return 0;
@@ -317,86 +712,417 @@ static int read_auth(void)
 static int send_schema(void)
 {
 	int8_t schema_status;
+
+	/* Fragment known by the gateway: skip it */
+	if (!schema_is_pending(msg_sensor_index))
+		return KNOT_ERR_INVALID;
 	/* Create schema for sensor in position=msg_sensor_index */
-	schema_status = knot_thing_create_schema(msg_sensor_index, &(msg.schema));
+	schema_status = knot_thing_create_schema(msg_sensor_index,
+							&(tx_msg.schema));
 
 	/* Return status if error found */
 	if (schema_status < 0)
 		return schema_status;
 
-	if (hal_comm_write(cli_sock, &msg,
-				sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
+	/*
+	 * The gateway commits the schema when it gets the end fragment,
+	 * so it is only sent once every other fragment was acknowledged.
+	 */
+	if (tx_msg.hdr.type == KNOT_MSG_SCHM_END_REQ && schm_sent)
+		return -EAGAIN;
+
+	if (link_write(&tx_msg,
+			sizeof(tx_msg.hdr) + tx_msg.hdr.payload_len) < 0)
 		/* TODO create a better error define in the protocol */
 		return KNOT_ERR_PERM;
 
 	return 0;
 }
 
+/*
+ * Outbound ring for the messages of an online thing. Each message is
+ * copied into its entry, so tx_msg and rx_msg are free once it is
+ * queued. A failed write stays at the head and is retried with
+ * exponential backoff while the loop goes on; when the ring is full the
+ * oldest message is dropped.
+ */
+static uint8_t tx_head, tx_count;
+static struct tx_entry {
+	uint32_t due;		/* Not written before this time */
+	uint8_t tries;		/* Failed writes so far */
+	uint8_t len;
+	uint8_t buf[TX_MSG_MAX > KNOT_THING_BATCH_MTU ?
+			TX_MSG_MAX : KNOT_THING_BATCH_MTU];
+} tx_queue[KNOT_THING_TX_QUEUE];
+
+#if KNOT_THING_INFLIGHT
+/*
+ * Data pushes written and not yet answered; len 0 marks a free entry.
+ * A gateway that appends the sample to KNOT_MSG_PUSH_DATA_RSP gets its
+ * answers matched to it; otherwise, as it answers in order, each
+ * response goes to the oldest push.
+ */
+static struct inflight {
+	uint32_t sent;
+	uint8_t resends;
+	uint8_t len;
+	uint8_t buf[sizeof(knot_msg_data)];
+} inflight[KNOT_THING_INFLIGHT];
+static knot_thing_push_stats push_stats;
+
+static inline uint8_t is_push(const knot_msg_header *hdr)
+{
+	return hdr->type == KNOT_MSG_PUSH_DATA_REQ ||
+				hdr->type == KNOT_MSG_PUSH_DELTA_REQ;
+}
+
+/*
+ * Whether the table can track every data push in the frame. A frame
+ * with more pushes than the table holds only waits for it to empty.
+ */
+static uint8_t inflight_room(const uint8_t *buffer, uint8_t len)
+{
+	const knot_msg_header *hdr;
+	struct inflight *push;
+	uint8_t msg_len, pushes = 0, room = 0;
+
+	while (len >= sizeof(*hdr)) {
+		hdr = (const knot_msg_header *) buffer;
+		msg_len = sizeof(*hdr) + hdr->payload_len;
+		if (msg_len > len)
+			break;
+
+		pushes += is_push(hdr);
+		buffer += msg_len;
+		len -= msg_len;
+	}
+
+	for (push = inflight; push < inflight + KNOT_THING_INFLIGHT; push++)
+		room += push->len == 0;
+
+	return room >= MIN(pushes, KNOT_THING_INFLIGHT);
+}
+
+/* Oldest push of the sample in rsp, or of any sample if rsp is NULL */
+static struct inflight *inflight_oldest(const knot_thing_msg_push_rsp *rsp)
+{
+	struct inflight *push, *oldest = NULL;
+	const knot_msg_data *data;
+	uint8_t len;
+
+	for (push = inflight; push < inflight + KNOT_THING_INFLIGHT; push++) {
+		if (push->len == 0)
+			continue;
+
+		data = (const knot_msg_data *) push->buf;
+		len = rsp ? rsp->hdr.payload_len - sizeof(rsp->result) : 0;
+		if (len && (data->hdr.payload_len != len ||
+				memcmp(&data->sensor_id, &rsp->sensor_id, len)))
+			continue;
+
+		if (!oldest || (int32_t) (push->sent - oldest->sent) < 0)
+			oldest = push;
+	}
+
+	return oldest;
+}
+
+/* Tracks every data push in a frame just written */
+static void inflight_track(const uint8_t *buffer, uint8_t len)
+{
+	const knot_msg_header *hdr;
+	struct inflight *push;
+	uint8_t msg_len;
+
+	while (len >= sizeof(*hdr)) {
+		hdr = (const knot_msg_header *) buffer;
+		msg_len = sizeof(*hdr) + hdr->payload_len;
+		if (msg_len > len)
+			break;
+
+		if (is_push(hdr)) {
+			for (push = inflight; push < inflight +
+					KNOT_THING_INFLIGHT && push->len; push++)
+				;
+
+			/*
+			 * Full, only with a frame of more pushes than the
+			 * table holds: the oldest outcome will never be known
+			 */
+			if (push == inflight + KNOT_THING_INFLIGHT) {
+				push = inflight_oldest(NULL);
+				push_stats.untracked++;
+			}
+
+			push->sent = hal_time_ms();
+			push->resends = 0;
+			push->len = msg_len;
+			memcpy(push->buf, buffer, msg_len);
+			push_stats.sent++;
+		}
+
+		buffer += msg_len;
+		len -= msg_len;
+	}
+}
+
+/*
+ * Sends the push again, as it was, unless it ran out of tries. A delta
+ * is not resent: later deltas went on top of it, so the item is read
+ * again and sent in full instead. The push keeps its entry and is
+ * written at once, not queued: the queue may itself be waiting for
+ * room in the table. A failed write times out like a lost response.
+ */
+static void inflight_resend(struct inflight *push)
+{
+	knot_msg_data *data = (knot_msg_data *) push->buf;
+	uint8_t id = data->sensor_id;
+
+	if (push->resends >= KNOT_THING_TX_RETRIES) {
+		push_stats.lost++;
+		push->len = 0;
+		return;
+	}
+
+	if (data->hdr.type == KNOT_MSG_PUSH_DELTA_REQ) {
+		if (knot_thing_data_item_read(id, data) < 0) {
+			/* Pending reads are answered by async_send() */
+			push_stats.lost++;
+			push->len = 0;
+			return;
+		}
+
+		data->hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+		data->sensor_id = id;
+		push->len = sizeof(data->hdr) + data->hdr.payload_len;
+	}
+
+	push_stats.resent++;
+	push_stats.sent++;
+	push->resends++;
+	push->sent = hal_time_ms();
+	link_write(push->buf, push->len);
+}
+
+static void inflight_ack(const knot_thing_msg_push_rsp *rsp)
+{
+	struct inflight *push;
+	uint32_t latency;
+
+	push = inflight_oldest(rsp);
+	if (!push)
+		return;
+
+	if (rsp->result != 0) {
+		push_stats.failed++;
+		inflight_resend(push);
+		return;
+	}
+
+	latency = hal_time_ms() - push->sent;
+	push_stats.acked++;
+	push_stats.latency_sum_ms += latency;
+	if (latency > push_stats.latency_max_ms)
+		push_stats.latency_max_ms = latency;
+
+	push->len = 0;
+}
+
+/* The oldest push without a response in time is sent again */
+static void inflight_expire(void)
+{
+	struct inflight *push = inflight_oldest(NULL);
+
+	if (push && hal_timeout(hal_time_ms(), push->sent,
+					KNOT_THING_PUSH_TIMEOUT_MS) > 0) {
+		push_stats.timeouts++;
+		inflight_resend(push);
+	}
+}
+
+static void inflight_clear(void)
+{
+	struct inflight *push;
+
+	for (push = inflight; push < inflight + KNOT_THING_INFLIGHT; push++) {
+		if (push->len)
+			push_stats.lost++;
+		push->len = 0;
+	}
+}
+#endif
+
+void knot_thing_protocol_stats(knot_thing_stats *out)
+{
+#if KNOT_THING_STATS
+	memcpy(out, &stats, sizeof(*out));
+#else
+	memset(out, 0, sizeof(*out));
+#endif
+}
+
+void knot_thing_protocol_push_stats(knot_thing_push_stats *out)
+{
+#if KNOT_THING_INFLIGHT
+	memcpy(out, &push_stats, sizeof(*out));
+#else
+	memset(out, 0, sizeof(*out));
+#endif
+}
+
+static inline void tx_pop(void)
+{
+	tx_head = (tx_head + 1) % KNOT_THING_TX_QUEUE;
+	tx_count--;
+}
+
+/* Writes the queued messages, in order, until one fails */
+static void tx_drain(void)
+{
+	struct tx_entry *entry;
+	uint32_t now;
+
+	while (tx_count) {
+		entry = &tx_queue[tx_head];
+		now = hal_time_ms();
+		if (entry->tries && (int32_t) (now - entry->due) < 0)
+			return;
+#if KNOT_THING_INFLIGHT
+		/* Held until responses or timeouts free the table */
+		if (!inflight_room(entry->buf, entry->len))
+			return;
+#endif
+
+		if (link_write(entry->buf, entry->len) >= 0) {
+			hal_log_str("DT");
+#if KNOT_THING_INFLIGHT
+			inflight_track(entry->buf, entry->len);
+#endif
+			tx_pop();
+			continue;
+		}
+
+		hal_log_str("DT ERR");
+		if (++entry->tries > KNOT_THING_TX_RETRIES) {
+			STAT_INC(tx_dropped);
+			tx_pop();
+			continue;
+		}
+
+		entry->due = now + ((uint32_t) KNOT_THING_TX_BACKOFF_MS <<
+							(entry->tries - 1));
+		return;
+	}
+}
+
+static int tx_send(const void *buffer, uint8_t len)
+{
+	struct tx_entry *entry;
+
+	if (len > sizeof(entry->buf))
+		return -EMSGSIZE;
+
+	/* Events wait while the queue is full; replies push out the oldest */
+	if (tx_count == KNOT_THING_TX_QUEUE) {
+		STAT_INC(tx_dropped);
+		tx_pop();
+	}
+
+	entry = &tx_queue[(tx_head + tx_count) % KNOT_THING_TX_QUEUE];
+	memcpy(entry->buf, buffer, len);
+	entry->len = len;
+	entry->tries = 0;
+	tx_count++;
+
+	tx_drain();
+
+	return 0;
+}
+
 static int msg_set_config(uint8_t sensor_id)
 {
 	int8_t err;
 
-	err = knot_thing_config_data_item(msg.config.sensor_id,
-					msg.config.values.event_flags,
-					msg.config.values.time_sec,
-					&(msg.config.values.lower_limit),
-					&(msg.config.values.upper_limit));
+	err = knot_thing_config_data_item(rx_msg.config.sensor_id,
+					rx_msg.config.values.event_flags,
+					rx_msg.config.values.time_sec,
+					&(rx_msg.config.values.lower_limit),
+					&(rx_msg.config.values.upper_limit));
 	if (err)
 		return KNOT_ERR_PERM;
 
-	msg.item.sensor_id = sensor_id;
-	msg.hdr.type = KNOT_MSG_PUSH_CONFIG_RSP;
-	msg.hdr.payload_len = sizeof(msg.item.sensor_id);
+	/* Optional change filter after the config values */
+	if (rx_msg.hdr.payload_len >= sizeof(rx_msg.config.sensor_id) +
+		sizeof(rx_msg.config.values) + sizeof(knot_thing_filter) &&
+		knot_thing_filter_data_item(rx_msg.config.sensor_id,
+			(const knot_thing_filter *)
+					(&rx_msg.config.values + 1)) < 0)
+		return KNOT_ERR_PERM;
 
-	if (hal_comm_write(cli_sock, &msg,
-				sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
-		return -1;
+	rx_msg.item.sensor_id = sensor_id;
+	rx_msg.hdr.type = KNOT_MSG_PUSH_CONFIG_RSP;
+	rx_msg.hdr.payload_len = sizeof(rx_msg.item.sensor_id);
 
-	return 0;
+	return tx_send(&rx_msg, sizeof(rx_msg.hdr) +
+					rx_msg.hdr.payload_len);
 }
 
 static int msg_set_data(uint8_t sensor_id)
 {
 	int8_t err;
 
-	err = knot_thing_data_item_write(sensor_id, &(msg.data));
+	err = knot_thing_data_item_write(sensor_id, &(rx_msg.data));
+#if KNOT_THING_ASYNC
+	/* Echoed by async_send() once the write completes */
+	if (err == KNOT_THING_PENDING)
+		return 0;
+#endif
 
 	/*
 	 * GW must be aware if the data was succesfully set, so we resend
 	 * the request only changing the header type
 	 */
-	msg.hdr.type = KNOT_MSG_PUSH_DATA_RSP;
+	rx_msg.hdr.type = KNOT_MSG_PUSH_DATA_RSP;
 	/* TODO: Improve error handling: Sensor not found, invalid data, etc */
 	if (err < 0)
-		msg.hdr.type = KNOT_ERR_INVALID;
-
-	if (hal_comm_write(cli_sock, &msg,
-				sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
-		return -1;
+		rx_msg.hdr.type = KNOT_ERR_INVALID;
 
-	return 0;
+	return tx_send(&rx_msg, sizeof(rx_msg.hdr) +
+					rx_msg.hdr.payload_len);
 }
 
 static int msg_get_data(uint8_t sensor_id)
 {
 	int8_t err;
 
-	err = knot_thing_data_item_read(sensor_id, &(msg.data));
+	err = knot_thing_data_item_read(sensor_id, &(tx_msg.data));
 	if (err == -2)
 		return err;
+#if KNOT_THING_ASYNC
+	/* Sent by async_send() once the value arrives */
+	if (err == KNOT_THING_PENDING)
+		return 0;
+#endif
 
-	msg.hdr.type = KNOT_MSG_PUSH_DATA_REQ;
+	tx_msg.hdr.type = KNOT_MSG_PUSH_DATA_REQ;
 	if (err < 0)
-		msg.hdr.type = KNOT_ERR_PERM;
+		tx_msg.hdr.type = KNOT_ERR_PERM;
 
-	msg.data.sensor_id = sensor_id;
+	tx_msg.data.sensor_id = sensor_id;
 
-	if (hal_comm_write(cli_sock, &msg,
-				sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
-		return -1;
+	return tx_send(&tx_msg, sizeof(tx_msg.hdr) +
+					tx_msg.hdr.payload_len);
+}
 
-	return 0;
+#if KNOT_THING_ASYNC
+/* Answers the polls and writes completed since the last call */
+static void async_send(void)
+{
+	while (tx_count < KNOT_THING_TX_QUEUE &&
+			knot_thing_async_reply(&tx_msg.data) == 0)
+		tx_send(&tx_msg, sizeof(tx_msg.hdr) + tx_msg.hdr.payload_len);
 }
+#endif
 
 static inline int is_uuid(const char *string)
 {
@@ -404,13 +1130,36 @@ static inline int is_uuid(const char *string)
 		string[13] == '-' && string[18] == '-' && string[23] == '-');
 }
 
+/* Stored credentials into the auth request; storage is read only once */
+static void cred_read(knot_msg_authentication *auth)
+{
+#if KNOT_THING_CRED_CACHE
+	if (cred_cached) {
+		memcpy(auth->uuid, cred.uuid, sizeof(cred.uuid));
+		memcpy(auth->token, cred.token, sizeof(cred.token));
+		return;
+	}
+#endif
+	hal_storage_read_end(HAL_STORAGE_ID_UUID, &(auth->uuid),
+					KNOT_PROTOCOL_UUID_LEN);
+	hal_storage_read_end(HAL_STORAGE_ID_TOKEN, &(auth->token),
+				KNOT_PROTOCOL_TOKEN_LEN);
+#if KNOT_THING_CRED_CACHE
+	if (is_uuid(auth->uuid)) {
+		memcpy(cred.uuid, auth->uuid, sizeof(cred.uuid));
+		memcpy(cred.token, auth->token, sizeof(cred.token));
+		cred_cached = 1;
+	}
+#endif
+}
+
+/* Only called when rx_msg holds nothing to handle */
 static int8_t mgmt_read(void)
 {
-	uint8_t buffer[MTU];
-	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) buffer;
+	struct mgmt_nrf24_header *mhdr = (struct mgmt_nrf24_header *) &rx_msg;
 	ssize_t retval;
 
-	retval = hal_comm_read(sock, buffer, sizeof(buffer));
+	retval = hal_comm_read(sock, &rx_msg, sizeof(rx_msg));
 	if (retval < 0)
 		return retval;
 
@@ -427,31 +1176,238 @@ static int8_t mgmt_read(void)
 	return 0;
 }
 
+/* States that take gateway messages from the data socket */
+static inline uint8_t state_reads(uint8_t state)
+{
+	return state == STATE_AUTHENTICATING || state == STATE_REGISTERING ||
+		state == STATE_SCHM_RSP || state == STATE_ONLINE ||
+		state == STATE_RUNNING;
+}
+
+/*
+ * One pass over both sockets, with a single read in the usual case. The
+ * data socket is read for the states that take messages, into rx_msg
+ * and rx_len. The management socket only tells that the link went down,
+ * so it is read when the data socket had nothing, at most once every
+ * KNOT_THING_MGMT_POLL_MS. Returns -ENOTCONN once the link is gone.
+ */
+static int8_t link_poll(void)
+{
+	rx_len = -EAGAIN;
+
+	if (state_reads(run_state)) {
+		rx_len = hal_comm_read(cli_sock, &rx_msg, sizeof(rx_msg));
+		if (rx_len > 0) {
+			STAT_INC(frames_received);
+			return 0;
+		}
+
+		if (rx_len == -ENOTCONN)
+			return -ENOTCONN;
+	}
+
+	if (hal_timeout(hal_time_ms(), mgmt_time,
+					KNOT_THING_MGMT_POLL_MS) == 0)
+		return 0;
+
+	mgmt_time = hal_time_ms();
+
+	return mgmt_read();
+}
+
+#if KNOT_THING_BATCH_MTU
+/* The batch waits here while the queue is full, not to push one out */
+static void batch_flush(void)
+{
+	if (batch_len == 0 || tx_count == KNOT_THING_TX_QUEUE)
+		return;
+
+	tx_send(batch, batch_len);
+	batch_len = 0;
+}
+
+/*
+ * Queues the data message, sending the batch first if it can't fit.
+ * Only called while the queue has room, so that flush goes through.
+ */
+static void batch_add(const void *buffer)
+{
+	const knot_msg_header *hdr = buffer;
+	uint8_t len = sizeof(*hdr) + hdr->payload_len;
+
+	if (batch_len + len > sizeof(batch))
+		batch_flush();
+
+	if (len > sizeof(batch)) {
+		tx_send(buffer, len);
+		return;
+	}
+
+	if (batch_len == 0)
+		batch_time = hal_time_ms();
+
+	memcpy(batch + batch_len, buffer, len);
+	batch_len += len;
+}
+#endif
+
+#if KNOT_THING_OFFLINE_SAMPLES
+/*
+ * Samples taken while offline, oldest first: the ones spilled to storage
+ * and then the ones in RAM.
+ */
+struct __attribute__ ((packed)) offline_sample {
+	uint32_t time;
+	knot_msg_data data;
+};
+_Static_assert(sizeof(struct offline_sample) ==
+		KNOT_THING_OFFLINE_SAMPLE_SIZE,
+		"KNOT_THING_OFFLINE_SAMPLE_SIZE is out of date");
+static struct offline_sample offline[KNOT_THING_OFFLINE_SAMPLES];
+static uint8_t offline_head, offline_count;
+#if KNOT_THING_OFFLINE_SPILL
+static uint8_t spill_head, spill_count;
+
+static inline uint16_t spill_addr(uint8_t index)
+{
+	return KNOT_THING_OFFLINE_STORAGE_ADDR +
+		(uint16_t) (index % KNOT_THING_OFFLINE_SPILL) *
+					sizeof(struct offline_sample);
+}
+
+/* Appends to the storage ring, dropping its oldest sample if full */
+static void offline_spill(const struct offline_sample *sample)
+{
+	if (spill_count == KNOT_THING_OFFLINE_SPILL) {
+		spill_head = (spill_head + 1) % KNOT_THING_OFFLINE_SPILL;
+		spill_count--;
+	}
+
+	hal_storage_write(spill_addr(spill_head + spill_count),
+			(const uint8_t *) sample, sizeof(*sample));
+	spill_count++;
+}
+#endif
+
+static void offline_record(void)
+{
+	struct offline_sample *sample;
+	knot_msg_data data;
+
+	for (;;) {
+		/*
+		 * Raw samples are kept in full, not as deltas: the ring
+		 * drops its oldest ones and the gateway gets a new base
+		 * once online, before any of them is flushed.
+		 */
+		knot_thing_raw_keyframe();
+		if (knot_thing_verify_events(&data) < 0)
+			break;
+
+		if (offline_count == KNOT_THING_OFFLINE_SAMPLES) {
+#if KNOT_THING_OFFLINE_SPILL
+			offline_spill(&offline[offline_head]);
+#endif
+			offline_head = (offline_head + 1) %
+						KNOT_THING_OFFLINE_SAMPLES;
+			offline_count--;
+		}
+
+		sample = &offline[(offline_head + offline_count) %
+						KNOT_THING_OFFLINE_SAMPLES];
+		sample->time = hal_time_ms();
+		memcpy(&sample->data, &data, sizeof(data));
+		offline_count++;
+
+		if (!KNOT_THING_FULL_SWEEP)
+			break;
+	}
+}
+
+/* Takes the oldest sample out; -1 if there is none */
+static int offline_pop(struct offline_sample *sample)
+{
+#if KNOT_THING_OFFLINE_SPILL
+	if (spill_count) {
+		hal_storage_read(spill_addr(spill_head), (uint8_t *) sample,
+							sizeof(*sample));
+		spill_head = (spill_head + 1) % KNOT_THING_OFFLINE_SPILL;
+		spill_count--;
+		return 0;
+	}
+#endif
+	if (offline_count == 0)
+		return -1;
+
+	memcpy(sample, &offline[offline_head], sizeof(*sample));
+	offline_head = (offline_head + 1) % KNOT_THING_OFFLINE_SAMPLES;
+	offline_count--;
+
+	return 0;
+}
+
+static inline uint8_t offline_pending(void)
+{
+#if KNOT_THING_OFFLINE_SPILL
+	if (spill_count)
+		return 1;
+#endif
+	return offline_count != 0;
+}
+
+/* Sends the oldest samples with their age, without overflowing the queue */
+static void offline_flush(void)
+{
+	knot_thing_msg_aged *aged = &tx_msg.aged;
+	struct offline_sample sample;
+	uint8_t sent;
+
+	for (sent = 0; sent < KNOT_THING_OFFLINE_FLUSH &&
+			tx_count < KNOT_THING_TX_QUEUE &&
+			offline_pop(&sample) == 0; sent++) {
+		aged->hdr.type = KNOT_MSG_PUSH_AGED_REQ;
+		aged->hdr.payload_len = sizeof(aged->age_ms) +
+			sizeof(sample.data.hdr) + sample.data.hdr.payload_len;
+		aged->age_ms = hal_time_ms() - sample.time;
+		memcpy(&aged->data, &sample.data, sizeof(sample.data));
+#if KNOT_THING_BATCH_MTU
+		batch_add(aged);
+#else
+		tx_send(aged, sizeof(aged->hdr) + aged->hdr.payload_len);
+#endif
+	}
+}
+#endif
+
 static void read_online_messages(void)
 {
-	if (hal_comm_read(cli_sock, &msg, sizeof(msg)) <= 0)
+	if (rx_len <= 0)
 		return;
 
 	/* There is a message to read */
-	switch (msg.hdr.type) {
+	switch (rx_msg.hdr.type) {
 	case KNOT_MSG_PUSH_CONFIG_REQ:
-		msg_set_config(msg.config.sensor_id);
+		msg_set_config(rx_msg.config.sensor_id);
 		break;
 
 	case KNOT_MSG_PUSH_DATA_REQ:
-		msg_set_data(msg.data.sensor_id);
+		msg_set_data(rx_msg.data.sensor_id);
 		break;
 
 	case KNOT_MSG_POLL_DATA_REQ:
-		msg_get_data(msg.item.sensor_id);
+		msg_get_data(rx_msg.item.sensor_id);
 		break;
 
 	case KNOT_MSG_PUSH_DATA_RSP:
 		hal_log_str("DT RSP");
-		if (msg.action.result != 0) {
+#if KNOT_THING_INFLIGHT
+		inflight_ack((const knot_thing_msg_push_rsp *) &rx_msg);
+#else
+		if (rx_msg.action.result != 0) {
 			hal_log_str("DT R ERR");
-			msg_get_data(msg.item.sensor_id);
+			msg_get_data(rx_msg.item.sensor_id);
 		}
+#endif
 		break;
 	case KNOT_MSG_UNREG_REQ:
 		send_unregister();
@@ -462,10 +1418,112 @@ static void read_online_messages(void)
 	}
 }
 
-int knot_thing_protocol_run(void)
+uint8_t knot_thing_protocol_state(void)
+{
+	return run_state;
+}
+
+/* Milliseconds from now until start + timeout, 0 if already expired */
+static uint32_t time_left(uint32_t now, uint32_t start, uint32_t timeout)
 {
-	static uint8_t	run_state = STATE_DISCONNECTED;
+	uint32_t elapsed = now - start;
+
+	return elapsed >= timeout ? 0 : timeout - elapsed;
+}
+
+/* Milliseconds from now until due, 0 if already past */
+static uint32_t time_until(uint32_t now, uint32_t due)
+{
+	return (int32_t) (due - now) > 0 ? due - now : 0;
+}
+
+uint32_t knot_thing_protocol_next_ms(void)
+{
+	uint32_t now = hal_time_ms(), next;
+
+	if (enable_run == 0)
+		return KNOT_THING_POLL_MS;
+
+	switch (run_state) {
+	case STATE_DISCONNECTED:
+		/* Backing off after an error or a lost link */
+		next = time_left(now, retry_time, retry_wait);
+		if (next == 0)
+			return 0;
+#if KNOT_THING_OFFLINE_SAMPLES
+		next = MIN(next, knot_thing_next_event_ms());
+#endif
+		break;
+	case STATE_ACCEPTING:
+		/* Waiting for the gateway to connect */
+		next = KNOT_THING_POLL_MS;
+#if KNOT_THING_OFFLINE_SAMPLES
+		next = MIN(next, knot_thing_next_event_ms());
+#endif
+		break;
+	case STATE_AUTHENTICATING:
+	case STATE_REGISTERING:
+	case STATE_SCHM_RSP:
+		/* Waiting for a response or the retransmission */
+		next = MIN(KNOT_THING_POLL_MS, time_left(now, last_timeout,
+				run_state == STATE_SCHM_RSP ? schema_timeout() :
+						RETRANSMISSION_TIMEOUT));
+#if KNOT_THING_OFFLINE_SAMPLES
+		next = MIN(next, knot_thing_next_event_ms());
+#endif
+		break;
+	case STATE_RUNNING:
+		next = KNOT_THING_POLL_MS;
+		if (tx_count < KNOT_THING_TX_QUEUE)
+			next = MIN(next, knot_thing_next_event_ms());
+#if KNOT_THING_OFFLINE_SAMPLES
+		/* A full queue is waited for below, not spun on */
+		if (offline_pending() && tx_count < KNOT_THING_TX_QUEUE)
+			next = 0;
+#endif
+		if (tx_count
+#if KNOT_THING_INFLIGHT
+			/* Otherwise waiting for the oldest push below */
+			&& inflight_room(tx_queue[tx_head].buf,
+						tx_queue[tx_head].len)
+#endif
+			)
+			next = MIN(next, time_until(now,
+					tx_queue[tx_head].tries ?
+					tx_queue[tx_head].due : now));
+#if KNOT_THING_INFLIGHT
+		if (inflight_oldest(NULL))
+			next = MIN(next, time_left(now,
+					inflight_oldest(NULL)->sent,
+					KNOT_THING_PUSH_TIMEOUT_MS));
+#endif
+#if KNOT_THING_BATCH_MTU
+		/* A held batch goes once the queue above makes room */
+		if (batch_len && tx_count < KNOT_THING_TX_QUEUE)
+			next = MIN(next, time_left(now, batch_time,
+						KNOT_THING_BATCH_HOLD_MS));
+#endif
+		break;
+	default:
+		/* Transient states move on at the next call */
+		return 0;
+	}
+
+	next = MIN(next, time_left(now, led_time, led_interval));
+
+	if (unreg_timeout)
+		next = MIN(next, time_left(now, unreg_timeout, 10000));
+
+	/* Clear storage button held down */
+	if (clear_time)
+		next = MIN(next, time_left(now, clear_time,
+						BUTTON_PRESSED_TIME));
+
+	return next;
+}
 
+int knot_thing_protocol_run(void)
+{
 	struct nrf24_mac peer;
 	int8_t retval;
 
@@ -475,23 +1533,60 @@ int knot_thing_protocol_run(void)
 	verify_clear_data();
 
 	if (enable_run == 0) {
+		halt_blink();
 		return -1;
 	}
 
-	if (run_state >= STATE_CONNECTED) {
-		if (mgmt_read() == -ENOTCONN)
-			run_state = STATE_DISCONNECTED;
+#if KNOT_THING_STATS
+	/* The time since the last call went to the state it left */
+	stats.state_ms[run_state] += hal_time_ms() - stats_time;
+	stats_time = hal_time_ms();
+#endif
+
+	rx_len = -EAGAIN;
+	if (run_state >= STATE_CONNECTED && link_poll() == -ENOTCONN) {
+		STAT_INC(link_losses);
+#if KNOT_THING_RESUME_MS
+		resume = run_state == STATE_RUNNING && tx_count == 0;
+#if KNOT_THING_BATCH_MTU
+		resume = resume && batch_len == 0;
+#endif
+#if KNOT_THING_INFLIGHT
+		resume = resume && !inflight_oldest(NULL);
+#endif
+		resume_time = hal_time_ms();
+#endif
+		retry_jitter();
+		run_state = STATE_DISCONNECTED;
 	}
 
 	if (unreg_timeout && hal_timeout(hal_time_ms(), unreg_timeout, 10000) > 0)
 		thing_disconnect_exit();
 
+#if KNOT_THING_OFFLINE_SAMPLES
+	/* Events are not lost while offline: they wait with their time */
+	if (run_state != STATE_ONLINE && run_state != STATE_RUNNING)
+		offline_record();
+#endif
+
 	/* Network message handling state machine */
 	switch (run_state) {
 	case STATE_DISCONNECTED:
 		/* Internally listen starts broadcasting presence*/
 		led_status(BLINK_DISCONNECTED);
 		hal_comm_close(cli_sock);
+		/* Held data is lost with the link */
+		tx_count = 0;
+#if KNOT_THING_INFLIGHT
+		inflight_clear();
+#endif
+#if KNOT_THING_BATCH_MTU
+		batch_len = 0;
+#endif
+		/* Listen again only once the backoff or jitter is over */
+		if (hal_timeout(hal_time_ms(), retry_time, retry_wait) == 0)
+			break;
+
 		hal_log_str("DISC");
 		if (hal_comm_listen(sock) < 0) {
 			break;
@@ -514,6 +1609,7 @@ int knot_thing_protocol_run(void)
 			run_state = STATE_DISCONNECTED;
 			break;
 		}
+		STAT_INC(links);
 		run_state = STATE_CONNECTED;
 		hal_log_str("CONN");
 		break;
@@ -524,20 +1620,17 @@ int knot_thing_protocol_run(void)
 		 * the auth request, otherwise register request
 		 */
 		led_status(BLINK_STABLISHING);
-		hal_storage_read_end(HAL_STORAGE_ID_UUID, &(msg.auth.uuid),
-					KNOT_PROTOCOL_UUID_LEN);
-		hal_storage_read_end(HAL_STORAGE_ID_TOKEN, &(msg.auth.token),
-				KNOT_PROTOCOL_TOKEN_LEN);
+		cred_read(&tx_msg.auth);
 
-		if (is_uuid(msg.auth.uuid)) {
+		if (is_uuid(tx_msg.auth.uuid)) {
 			run_state = STATE_AUTHENTICATING;
 			hal_log_str("AUTH");
-			msg.hdr.type = KNOT_MSG_AUTH_REQ;
-			msg.hdr.payload_len = KNOT_PROTOCOL_UUID_LEN +
+			tx_msg.hdr.type = KNOT_MSG_AUTH_REQ;
+			tx_msg.hdr.payload_len = KNOT_PROTOCOL_UUID_LEN +
 						KNOT_PROTOCOL_TOKEN_LEN;
 
-			if (hal_comm_write(cli_sock, &msg,
-				sizeof(msg.hdr) + msg.hdr.payload_len) < 0)
+			if (link_write(&tx_msg, sizeof(tx_msg.hdr) +
+						tx_msg.hdr.payload_len) < 0)
 				run_state = STATE_ERROR;
 		} else {
 			hal_log_str("REG");
@@ -556,37 +1649,59 @@ int knot_thing_protocol_run(void)
 	case STATE_AUTHENTICATING:
 		led_status(BLINK_STABLISHING);
 		retval = read_auth();
+#if KNOT_THING_RESUME_MS
+		/* Same items and nothing lost: carry on where it was left */
+		if (retval == 0 && resume && schema_check() == 0 &&
+			hal_timeout(hal_time_ms(), resume_time,
+						KNOT_THING_RESUME_MS) == 0) {
+			resume = 0;
+			retry_count = 0;
+			run_state = STATE_RUNNING;
+			hal_log_str("RSM");
+			break;
+		}
+		if (retval != -EAGAIN)
+			resume = 0;
+#endif
 		if (retval == 0) {
 			run_state = STATE_ONLINE;
 			hal_log_str("ONLN");
-			/* Checks if all the schemas were sent to the GW and */
-			hal_storage_read_end(HAL_STORAGE_ID_SCHEMA_FLAG,
-					&schema_flag, sizeof(schema_flag));
-			if (!schema_flag)
+			/* Sends only the schemas the GW does not have */
+			if (schema_check()) {
+				schema_start();
 				run_state = STATE_SCHM;
+			}
 		}
 		else if (retval != -EAGAIN)
-			halt_blinking_led(AUTH_ERROR);
+			run_state = STATE_ERROR;
 		else if (hal_timeout(hal_time_ms(), last_timeout,
-						RETRANSMISSION_TIMEOUT) > 0)
+						RETRANSMISSION_TIMEOUT) > 0) {
+			STAT_INC(retransmits);
 			run_state = STATE_CONNECTED;
+		}
 		break;
 
 	case STATE_REGISTERING:
 		led_status(BLINK_STABLISHING);
 		retval = read_register();
-		if (!retval)
+		if (!retval) {
+			schema_start();
 			run_state = STATE_SCHM;
+		}
 		else if (retval != -EAGAIN)
 			run_state = STATE_ERROR;
 		else if (hal_timeout(hal_time_ms(), last_timeout,
-						RETRANSMISSION_TIMEOUT) > 0)
+						RETRANSMISSION_TIMEOUT) > 0) {
+			STAT_INC(retransmits);
 			run_state = STATE_CONNECTED;
+		}
 		break;
 
 	/*
-	 * STATE_SCHM tries to send an schema and go to STATE_SCHM_RSP to
-	 * wait for the ack of this schema. If there is no schema for that
+	 * STATE_SCHM sends one schema fragment per call, starting a round at
+	 * msg_sensor_index, until KNOT_THING_SCHEMA_WINDOW fragments are in
+	 * flight or the end fragment is reached; then goes to STATE_SCHM_RSP
+	 * to wait for the acks of the round. If there is no schema for that
 	 * msg_sensor_index, increments and stays in the STATE_SCHM. If an
 	 * error occurs, goes to STATE_ERROR.
 	 */
@@ -597,11 +1712,21 @@ int knot_thing_protocol_run(void)
 		switch (retval) {
 		case 0:
 			last_timeout = hal_time_ms();
+			schm_frag[schm_sent].index = msg_sensor_index;
+			schm_frag[schm_sent].time = last_timeout;
+			schm_sent++;
+			msg_sensor_index++;
+			if (tx_msg.hdr.type == KNOT_MSG_SCHM_END_REQ ||
+					schm_sent >= KNOT_THING_SCHEMA_WINDOW)
+				run_state = STATE_SCHM_RSP;
+			break;
+		case -EAGAIN:
+			/* End fragment waits for the round to be acked */
 			run_state = STATE_SCHM_RSP;
 			break;
 		case KNOT_ERR_PERM:
 			run_state = STATE_ERROR;
-			msg_sensor_index = 0;
+			schema_restart(0);
 			break;
 		case KNOT_ERR_INVALID:
 			run_state = STATE_SCHM;
@@ -609,82 +1734,126 @@ int knot_thing_protocol_run(void)
 			break;
 		default:
 			run_state = STATE_ERROR;
-			msg_sensor_index = 0;
+			schema_restart(0);
 			break;
 		}
 		break;
 
 	/*
-	 * Receives the ack from the GW and returns to STATE_SCHM to send the
-	 * next schema. If it was the ack for the last schema, goes to
-	 * STATE_ONLINE. If it is not a KNOT_MSG_SCHM_FRAG_RSP, ignores. If the
-	 * result was not 0, goes to STATE_ERROR.
+	 * Receives the acks from the GW and returns to STATE_SCHM to send the
+	 * next round once every fragment of the round was acked. The schema
+	 * responses carry no sensor id and the GW answers in order, so acks
+	 * are counted rather than matched. If it was the ack for the last
+	 * schema, goes to STATE_ONLINE. If it is not a KNOT_MSG_SCHM_FRAG_RSP,
+	 * ignores. If the result was not 0 or the round timed out, the round
+	 * is sent again from its first fragment not acknowledged.
 	 */
 	case STATE_SCHM_RSP:
 		led_status(BLINK_STABLISHING);
 		hal_log_str("SCH_R");
-		if (hal_comm_read(cli_sock, &msg, sizeof(msg)) > 0) {
-			if (msg.hdr.type == KNOT_MSG_UNREG_REQ) {
+		if (rx_len > 0) {
+			if (rx_msg.hdr.type == KNOT_MSG_UNREG_REQ) {
 				send_unregister();
 				break;
 			}
-			if (msg.hdr.type != KNOT_MSG_SCHM_FRAG_RSP &&
-				msg.hdr.type != KNOT_MSG_SCHM_END_RSP)
+			if (rx_msg.hdr.type != KNOT_MSG_SCHM_FRAG_RSP &&
+				rx_msg.hdr.type != KNOT_MSG_SCHM_END_RSP)
 				break;
-			if (msg.action.result != 0) {
-				run_state = STATE_SCHM;
+			if (schm_stale) {
+				schm_stale--;
 				break;
 			}
-			if (msg.hdr.type != KNOT_MSG_SCHM_END_RSP) {
+			if (schm_acked >= schm_sent)
+				break;
+			if (rx_msg.action.result != 0) {
+				schema_resume(schm_sent - schm_acked - 1);
 				run_state = STATE_SCHM;
-				msg_sensor_index++;
+				break;
+			}
+			schema_rtt_sample((uint16_t) hal_time_ms() -
+						schm_frag[schm_acked].time);
+			schm_backoff = 0;
+			if (rx_msg.hdr.type != KNOT_MSG_SCHM_END_RSP) {
+				if (++schm_acked >= schm_sent) {
+					schema_restart(msg_sensor_index);
+					run_state = STATE_SCHM;
+				}
 				break;
 			}
 			/* All the schemas were sent to GW */
-			schema_flag = true;
-			hal_storage_write_end(HAL_STORAGE_ID_SCHEMA_FLAG,
-					&schema_flag, sizeof(schema_flag));
+			schema_commit();
 			run_state = STATE_ONLINE;
 			hal_log_str("ONLN");
-			msg_sensor_index = 0;
+			schema_restart(0);
 		} else if (hal_timeout(hal_time_ms(), last_timeout,
-						RETRANSMISSION_TIMEOUT) > 0)
+						schema_timeout()) > 0) {
+			if (schm_backoff < SCHM_BACKOFF_MAX)
+				schm_backoff++;
+			schema_resume(0);
 			run_state = STATE_SCHM;
+		}
 		break;
 
 	case STATE_ONLINE:
 		led_status(BLINK_ONLINE);
+		tx_drain();
 		read_online_messages();
+#if KNOT_THING_ASYNC
+		async_send();
+#endif
 		msg_get_data(knot_thing_get_sensor_id(msg_sensor_index));
 		msg_sensor_index++;
 		hal_log_str("DT");
-		if (msg_sensor_index >= KNOT_THING_DATA_MAX) {
+		if (msg_sensor_index >= knot_thing_get_item_count()) {
 			msg_sensor_index = 0;
+			retry_count = 0;
 			run_state = STATE_RUNNING;
 			hal_log_str("RUN");
 		}
 		break;
 	case STATE_RUNNING:
 		led_status(BLINK_ONLINE);
+#if KNOT_THING_INFLIGHT
+		inflight_expire();
+#endif
+		tx_drain();
 		read_online_messages();
-		/* If some event ocurred send msg_data */
-		if (knot_thing_verify_events(&(msg.data)) == 0) {
-			if (hal_comm_write(cli_sock, &msg,
-			sizeof(msg.hdr) + msg.hdr.payload_len) < 0) {
-				hal_log_str("DT ERR");
-				hal_comm_write(cli_sock, &msg,
-					sizeof(msg.hdr) + msg.hdr.payload_len);
-			} else {
-				hal_log_str("DT");
-			}
+#if KNOT_THING_ASYNC
+		async_send();
+#endif
+#if KNOT_THING_OFFLINE_SAMPLES
+		offline_flush();
+#endif
+		/*
+		 * If some event ocurred send msg_data; a full sweep finds all.
+		 * Events wait in their items while the queue is full, rather
+		 * than push out the messages held in it.
+		 */
+		while (tx_count < KNOT_THING_TX_QUEUE &&
+				knot_thing_verify_events(&(tx_msg.data)) == 0) {
+#if KNOT_THING_BATCH_MTU
+			batch_add(&tx_msg);
+#else
+			tx_send(&tx_msg, sizeof(tx_msg.hdr) +
+						tx_msg.hdr.payload_len);
+#endif
+			if (!KNOT_THING_FULL_SWEEP)
+				break;
 		}
+#if KNOT_THING_BATCH_MTU
+		if (batch_len && hal_timeout(hal_time_ms(), batch_time,
+					KNOT_THING_BATCH_HOLD_MS) > 0)
+			batch_flush();
+#endif
 		break;
 	case STATE_ERROR:
+		/* The backoff is waited in STATE_DISCONNECTED, not here */
 		hal_gpio_digital_write(PIN_LED_STATUS, 1);
 		hal_log_str("ERR");
-		/* TODO: Review error state handling */
+		STAT_INC(errors);
+		hal_comm_close(cli_sock);
+		retry_backoff();
 		run_state = STATE_DISCONNECTED;
-		hal_delay_ms(1000);
 		break;
 	default:
 		hal_log_str("INV");
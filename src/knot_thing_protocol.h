@@ -16,6 +16,18 @@ extern "C" {
 
 #include "knot_protocol.h"
 
+/* KNoT protocol client states */
+#define STATE_DISCONNECTED		0
+#define STATE_ACCEPTING			1
+#define STATE_CONNECTED			2
+#define STATE_AUTHENTICATING		3
+#define STATE_REGISTERING		4
+#define STATE_SCHM			5
+#define STATE_SCHM_RSP		6
+#define STATE_ONLINE			7
+#define STATE_RUNNING			8
+#define STATE_ERROR			9
+
 typedef int (*data_function)(uint8_t sensor_id, knot_msg_data *data);
 typedef int (*schema_function)(uint8_t sensor_id, knot_msg_schema *schema);
 typedef int (*config_function)(uint8_t sensor_id, uint8_t event_flags,
@@ -23,9 +35,76 @@ typedef int (*config_function)(uint8_t sensor_id, uint8_t event_flags,
 						knot_value_type *upper_limit);
 typedef int (*events_function)(knot_msg_data *data);
 
+/*
+ * KNOT_MSG_PUSH_DATA_RSP of gateways that append the sample answered
+ * (sensor id and value, as pushed); a plain knot_msg_result is matched
+ * to the oldest push instead.
+ */
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header hdr;
+	int8_t result;
+	uint8_t sensor_id;
+	knot_data payload;
+} knot_thing_msg_push_rsp;
+
+/*
+ * Sample taken age_ms before it was sent, while the thing was offline
+ * (KNOT_THING_OFFLINE_SAMPLES): the data message as it would have been
+ * pushed, header included.
+ */
+#ifndef KNOT_MSG_PUSH_AGED_REQ
+#define KNOT_MSG_PUSH_AGED_REQ		0x23
+#endif
+
+typedef struct __attribute__ ((packed)) {
+	knot_msg_header hdr;
+	uint32_t age_ms;
+	knot_msg_data data;
+} knot_thing_msg_aged;
+
+/* Delivery of data pushes, counted with KNOT_THING_INFLIGHT */
+typedef struct {
+	uint32_t sent;			/* Pushes written, resends included */
+	uint32_t acked;			/* Answered with success */
+	uint32_t failed;		/* Answered with an error */
+	uint32_t timeouts;		/* Not answered in time */
+	uint32_t resent;		/* Sent again after a failure or timeout */
+	uint32_t lost;			/* Given up or dropped with the link */
+	uint32_t untracked;		/* Forgotten to track a newer push */
+	uint32_t latency_sum_ms;	/* Write to response, acked pushes */
+	uint32_t latency_max_ms;
+} knot_thing_push_stats;
+
+/* State machine counters, kept with KNOT_THING_STATS */
+typedef struct {
+	uint32_t frames_sent;		/* Frames written to the gateway */
+	uint32_t frames_received;	/* Frames read from the gateway */
+	uint32_t write_errors;		/* Writes that failed */
+	uint32_t tx_dropped;		/* Queued messages given up or pushed out */
+	uint32_t retransmits;		/* Register or auth requests timed out */
+	uint32_t schema_retries;	/* Schema rounds failed or timed out */
+	uint32_t links;			/* Links accepted */
+	uint32_t link_losses;		/* Links lost */
+	uint32_t errors;		/* Times in STATE_ERROR */
+	uint32_t events_sent;		/* Item events reported */
+	uint32_t events_suppressed;	/* Polls that read an unsent change */
+	uint32_t state_ms[STATE_ERROR + 1];	/* Time in each STATE_* */
+} knot_thing_stats;
+
 int knot_thing_protocol_init(const char *thing_name);
 void knot_thing_protocol_exit(void);
 int knot_thing_protocol_run(void);
+/* Milliseconds until knot_thing_protocol_run() has work to do */
+uint32_t knot_thing_protocol_next_ms(void);
+
+/* Current STATE_* of the client state machine */
+uint8_t knot_thing_protocol_state(void);
+
+/* Copies the state machine counters; all 0 without KNOT_THING_STATS */
+void knot_thing_protocol_stats(knot_thing_stats *stats);
+
+/* Copies the push delivery counters; all 0 without KNOT_THING_INFLIGHT */
+void knot_thing_protocol_push_stats(knot_thing_push_stats *stats);
 
 
 #ifdef __cplusplus